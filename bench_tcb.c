@@ -0,0 +1,163 @@
+/*
+ * bench_tcb: cost of the scheduler's TCB scans before and after the
+ * hot/cold split, plus spawn and rotation through MAX_THREAD_NUM threads.
+ *
+ *     gcc -O2 -pthread bench_tcb.c uthreads.c thread_queue.c -o bench_tcb
+ *
+ * The "before" layout is the old thread_t with the sigjmp_buf between the
+ * state and the counters; "after" is the current thread_t. Each scan is the
+ * one schedule_next / uthread_spawn / uthread_terminate(0) does, run with a
+ * warm cache and after evicting it (the usual case once a thread has run).
+ * Spawn and rotation use default threads (uthread_spawn, static stacks);
+ * the UTHREAD_FPU spawn, which allocates and paints a larger stack, is
+ * reported separately.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "uthreads.h"
+
+#define SCAN_ROUNDS 20000
+#define EVICT_BYTES (16 * 1024 * 1024)
+
+typedef struct {
+    int tid;
+    thread_state_t state;
+    sigjmp_buf env;
+    int quantums;
+    int sleep_until;
+    thread_entry_point entry;
+} old_thread_t;
+
+static old_thread_t old_table[MAX_THREAD_NUM];
+static thread_t new_table[MAX_THREAD_NUM];
+static char evict_buf[EVICT_BYTES];
+static volatile long sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void evict_cache(void)
+{
+    for (size_t i = 0; i < EVICT_BYTES; i += 64) evict_buf[i]++;
+}
+
+/* free-slot scan + sleeper scan + live-thread scan, as the library does */
+#define SCAN_BODY(table)                                                  \
+    do {                                                                  \
+        long found = 0;                                                   \
+        for (int i = 1; i < MAX_THREAD_NUM; i++) {                        \
+            if (table[i].state == THREAD_UNUSED ||                        \
+                table[i].state == THREAD_TERMINATED) { found += i; break; } \
+        }                                                                 \
+        for (int i = 0; i < MAX_THREAD_NUM; i++) {                        \
+            if (table[i].state == THREAD_BLOCKED &&                       \
+                table[i].sleep_until != 0 && table[i].sleep_until <= r)   \
+                found += table[i].quantums;                               \
+        }                                                                 \
+        for (int i = 1; i < MAX_THREAD_NUM; i++) {                        \
+            if (table[i].state != THREAD_UNUSED) found++;                 \
+        }                                                                 \
+        sink += found;                                                    \
+    } while (0)
+
+static double scan_old(int cold)
+{
+    uint64_t total = 0;
+    for (int r = 0; r < SCAN_ROUNDS / (cold ? 20 : 1); r++) {
+        if (cold) evict_cache();
+        uint64_t t0 = now_ns();
+        SCAN_BODY(old_table);
+        total += now_ns() - t0;
+    }
+    return (double)total / (SCAN_ROUNDS / (cold ? 20 : 1));
+}
+
+static double scan_new(int cold)
+{
+    uint64_t total = 0;
+    for (int r = 0; r < SCAN_ROUNDS / (cold ? 20 : 1); r++) {
+        if (cold) evict_cache();
+        uint64_t t0 = now_ns();
+        SCAN_BODY(new_table);
+        total += now_ns() - t0;
+    }
+    return (double)total / (SCAN_ROUNDS / (cold ? 20 : 1));
+}
+
+static void fill_tables(void)
+{
+    /* all slots live and blocked, half of them sleeping: full scans */
+    for (int i = 0; i < MAX_THREAD_NUM; i++) {
+        old_table[i].tid = new_table[i].tid = i;
+        old_table[i].state = new_table[i].state = THREAD_BLOCKED;
+        old_table[i].quantums = new_table[i].quantums = i;
+        old_table[i].sleep_until = new_table[i].sleep_until = (i & 1) ? 1 << 30 : 0;
+    }
+}
+
+static volatile int rounds_left;
+
+static void spinner(void)
+{
+    for (;;) {
+        if (rounds_left > 0) --rounds_left;
+        uthread_yield();
+    }
+}
+
+/* Spawn a spinner into every free slot; returns the elapsed ns. */
+static uint64_t spawn_all(int flags)
+{
+    uint64_t t0 = now_ns();
+    for (int i = 1; i < MAX_THREAD_NUM; i++) {
+        int tid = flags ? uthread_spawn_ex(spinner, flags) : uthread_spawn(spinner);
+        if (tid < 0) exit(1);
+    }
+    return now_ns() - t0;
+}
+
+static void terminate_all(void)
+{
+    for (int i = 1; i < MAX_THREAD_NUM; i++) uthread_terminate(i);
+}
+
+int main(void)
+{
+    fill_tables();
+    printf("TCB scan over %d threads (ns per schedule_next-style pass)\n", MAX_THREAD_NUM);
+    printf("  %-28s %8s %8s\n", "", "warm", "cold");
+    printf("  %-28s %8.1f %8.1f\n", "before split", scan_old(0), scan_old(1));
+    printf("  %-28s %8.1f %8.1f\n", "after split", scan_new(0), scan_new(1));
+    printf("  sizeof old %zu, new %zu bytes per thread\n",
+           sizeof(old_thread_t), sizeof(thread_t));
+
+    uthread_init(100000);
+
+    uint64_t spawn_ns = spawn_all(0);
+
+    rounds_left = 100 * (MAX_THREAD_NUM - 1);
+    uint64_t t0 = now_ns();
+    while (rounds_left > 0) uthread_yield();
+    uint64_t rotate_ns = now_ns() - t0;
+    terminate_all();
+
+    uint64_t fpu_ns = spawn_all(UTHREAD_FPU);
+    terminate_all();
+
+    printf("spawn %d threads: %.1f us (%.0f ns each)\n", MAX_THREAD_NUM - 1,
+           spawn_ns / 1e3, (double)spawn_ns / (MAX_THREAD_NUM - 1));
+    printf("100 rotations through %d threads: %.1f ms (%.0f ns per switch)\n",
+           MAX_THREAD_NUM, rotate_ns / 1e6,
+           (double)rotate_ns / (100.0 * MAX_THREAD_NUM));
+    printf("spawn %d UTHREAD_FPU threads: %.1f us (%.0f ns each, first use of the slots)\n",
+           MAX_THREAD_NUM - 1, fpu_ns / 1e3, (double)fpu_ns / (MAX_THREAD_NUM - 1));
+
+    uthread_terminate(0);
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdatomic.h>
+#include "uthreads.h"
+
+/*
+ * Regression test: a UTHREAD_SHARED_STACK thread that terminates itself must
+ * give up the shared run stack. Its slot is then reused by a UTHREAD_FPU
+ * thread that blocks while other shared-stack threads take the run stack;
+ * the scheduler must not treat the new thread as the run-stack owner.
+ */
+
+atomic_int done;
+atomic_int rounds;
+int reused_tid;
+
+void shared_exit(void)
+{
+    uthread_terminate(uthread_get_tid());
+}
+
+void private_blocker(void)
+{
+    uthread_block(uthread_get_tid());
+    atomic_fetch_add(&done, 1);
+    uthread_terminate(uthread_get_tid());
+}
+
+void shared_worker(void)
+{
+    volatile char frame[512];
+    for (int i = 0; i < 20; i++) {
+        frame[i] = (char)i;
+        atomic_fetch_add(&rounds, 1);
+        uthread_yield();
+        for (int k = 0; k <= i; k++) {
+            if (frame[k] != (char)k) printf("shared stack corrupted\n");
+        }
+    }
+    atomic_fetch_add(&done, 1);
+    uthread_terminate(uthread_get_tid());
+}
+
+int main(void)
+{
+    atomic_store(&done, 0);
+    uthread_init(1000);
+
+    int first = uthread_spawn_ex(shared_exit, UTHREAD_SHARED_STACK);
+    uthread_join(first);
+
+    reused_tid = uthread_spawn_ex(private_blocker, UTHREAD_FPU);
+    if (reused_tid != first) {
+        printf("slot not reused (%d vs %d)\n", reused_tid, first);
+        return 1;
+    }
+    while (uthread_get_quantums(reused_tid) == 0)
+    {};
+
+    uthread_spawn_ex(shared_worker, UTHREAD_SHARED_STACK);
+    uthread_spawn_ex(shared_worker, UTHREAD_SHARED_STACK);
+    while (atomic_load(&done) < 2)
+    {};
+
+    uthread_resume(reused_tid);
+    while (atomic_load(&done) < 3)
+    {};
+
+    printf("Done!\n");
+    uthread_terminate(0);
+    return 0;
+}
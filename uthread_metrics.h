@@ -0,0 +1,65 @@
+#ifndef _UTHREAD_METRICS_H
+#define _UTHREAD_METRICS_H
+
+#include <stdint.h>
+#include "uthreads.h"
+
+/* ===================================================================== */
+/*             Layout of the shared-memory metrics segment               */
+/* ===================================================================== */
+
+/*
+ * uthread_metrics_export() creates a POSIX shared-memory object holding one
+ * uthread_metrics_t, and the scheduler republishes it at every context switch.
+ * Readers (e.g. uthread_top) map it read-only from another process.
+ *
+ * The snapshot is protected by a sequence lock: the writer makes seq odd,
+ * updates the fields and makes seq even again. A reader copies the snapshot
+ * and retries while seq was odd or changed during the copy:
+ *
+ *     do {
+ *         s = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+ *         copy = *m;
+ *         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *     } while ((s & 1) || s != __atomic_load_n(&m->seq, __ATOMIC_RELAXED));
+ */
+
+/** Value of uthread_metrics_t.magic. */
+#define UTHREAD_METRICS_MAGIC 0x75746d31u   /* "utm1" */
+
+/** Layout version; bumped whenever uthread_metrics_t changes. */
+#define UTHREAD_METRICS_VERSION 1
+
+/**
+ * @brief Per-thread part of the snapshot.
+ */
+typedef struct {
+    int32_t state;          /**< thread_state_t of the thread. */
+    int32_t quantums;       /**< Quantums the thread has run. */
+    int64_t sleep_until;    /**< Quantum at which a sleeping thread wakes, 0 if not sleeping. */
+    uint64_t run_ns;        /**< Time spent RUNNING, in CLOCK_MONOTONIC nanoseconds:
+                                 wall time from dispatch to the next scheduling point,
+                                 excluding scheduler work, idle waits and task steps.
+                                 Not CPU time: it also counts time the kernel spends
+                                 running other processes (no per-switch syscall). */
+} uthread_metrics_thread_t;
+
+/**
+ * @brief Whole snapshot, as it lies in the segment.
+ */
+typedef struct {
+    uint32_t magic;                 /**< UTHREAD_METRICS_MAGIC. */
+    uint32_t version;               /**< UTHREAD_METRICS_VERSION. */
+    uint32_t seq;                   /**< Sequence lock; odd while being written. */
+    int32_t pid;                    /**< Process that publishes the segment. */
+    int32_t max_threads;            /**< Entries in threads[] (MAX_THREAD_NUM). */
+    int32_t current_tid;            /**< Thread running after the last switch. */
+    int32_t quantum_usecs;          /**< Current quantum length. */
+    int32_t reserved;
+    uint64_t total_quantums;        /**< Same as uthread_get_total_quantums(). */
+    uint64_t switches;              /**< Context switches so far. */
+    uint64_t updated_ns;            /**< CLOCK_MONOTONIC time of the last update. */
+    uthread_metrics_thread_t threads[MAX_THREAD_NUM];
+} uthread_metrics_t;
+
+#endif
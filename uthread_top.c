@@ -0,0 +1,109 @@
+/*
+ * uthread_top - live view of a process that called uthread_metrics_export.
+ *
+ *     uthread_top <pid | /segment-name> [interval_ms]
+ *
+ * Maps the metrics segment read-only and redraws the thread table every
+ * interval (default 1000 ms). Only reads memory: the watched process is
+ * never stopped or signalled.
+ */
+#include "uthread_metrics.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+
+static const char *state_name(int32_t state)
+{
+    switch (state) {
+    case THREAD_READY:      return "READY";
+    case THREAD_RUNNING:    return "RUNNING";
+    case THREAD_BLOCKED:    return "BLOCKED";
+    case THREAD_TERMINATED: return "TERM";
+    default:                return "?";
+    }
+}
+
+/* Copy a consistent snapshot out of the segment (see uthread_metrics.h). */
+static void read_snapshot(const uthread_metrics_t *m, uthread_metrics_t *out)
+{
+    uint32_t s;
+    do {
+        s = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+        memcpy(out, (const void *)m, sizeof *out);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((s & 1) || s != __atomic_load_n(&m->seq, __ATOMIC_RELAXED));
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <pid | /segment-name> [interval_ms]\n", argv[0]);
+        return 1;
+    }
+
+    char name[64];
+    if (argv[1][0] == '/') {
+        snprintf(name, sizeof name, "%s", argv[1]);
+    } else {
+        snprintf(name, sizeof name, "/uthread.%s", argv[1]);
+    }
+    int interval_ms = (argc == 3) ? atoi(argv[2]) : 1000;
+    if (interval_ms <= 0) interval_ms = 1000;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        fprintf(stderr, "uthread_top: cannot open %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    const uthread_metrics_t *m = mmap(NULL, sizeof(uthread_metrics_t), PROT_READ,
+                                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        fprintf(stderr, "uthread_top: mmap failed: %s\n", strerror(errno));
+        return 1;
+    }
+    if (m->magic != UTHREAD_METRICS_MAGIC || m->version != UTHREAD_METRICS_VERSION ||
+        m->max_threads != MAX_THREAD_NUM) {
+        fprintf(stderr, "uthread_top: %s has an incompatible layout\n", name);
+        return 1;
+    }
+
+    static uthread_metrics_t cur, prev;
+    read_snapshot(m, &prev);
+
+    for (;;) {
+        struct timespec delay = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+        nanosleep(&delay, NULL);
+
+        if (kill(m->pid, 0) == -1 && errno == ESRCH) {
+            printf("process %d exited\n", (int)m->pid);
+            return 0;
+        }
+        read_snapshot(m, &cur);
+
+        double secs = interval_ms / 1000.0;
+        printf("\033[H\033[2J");
+        printf("pid %d  quantum %d us  total quantums %lu  switches/s %.0f  running tid %d\n\n",
+               (int)cur.pid, (int)cur.quantum_usecs, (unsigned long)cur.total_quantums,
+               (cur.switches - prev.switches) / secs, (int)cur.current_tid);
+        printf("%5s  %-8s %10s %12s %12s %6s\n",
+               "TID", "STATE", "QUANTA", "SLEEP_UNTIL", "RUN_MS", "%RUN");
+
+        for (int i = 0; i < MAX_THREAD_NUM; ++i) {
+            const uthread_metrics_thread_t *t = &cur.threads[i];
+            if (t->state == THREAD_UNUSED) continue;
+
+            /* a slot reused since the last sample restarts from zero */
+            uint64_t last = (prev.threads[i].run_ns <= t->run_ns) ? prev.threads[i].run_ns : 0;
+            double pct = (t->run_ns - last) / (secs * 1e7);
+            printf("%5d  %-8s %10d %12ld %12.1f %5.1f%%\n",
+                   i, state_name(t->state), (int)t->quantums, (long)t->sleep_until,
+                   t->run_ns / 1e6, pct);
+        }
+        fflush(stdout);
+        prev = cur;
+    }
+}
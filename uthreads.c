@@ -1,5 +1,17 @@
+#define _GNU_SOURCE     /* REG_RIP/REG_RBP, dladdr, pthread_getattr_np */
 #include "uthreads.h"
+#include "uthread_metrics.h"
 #include "thread_queue.h"
+#include <sys/auxv.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <ucontext.h>
+#include <dlfcn.h>
 
 
 
@@ -13,6 +25,11 @@ typedef unsigned long address_t;
 # define JB_PC 7
 # define SECOND 1000000
 
+/* Fresh stacks are filled with STACK_PAINT so the high-water mark can be
+ * found later; STACK_CANARY sits in the lowest word and must never change. */
+# define STACK_PAINT  0xA5
+# define STACK_CANARY 0x5AFEC0DE5AFEC0DEUL
+
 
 static address_t translate_address(address_t addr)
 {
@@ -24,6 +41,34 @@ static address_t translate_address(address_t addr)
     return ret;
 }
 
+/* Inverse of translate_address: recover a pointer stored in a jmp_buf. */
+static address_t untranslate_address(address_t addr)
+{
+    address_t ret;
+    __asm__ volatile ("ror $0x11, %0\n"
+                 "xor %%fs:0x30, %0\n"
+                 : "=g"(ret)
+                 : "0"(addr));
+    return ret;
+}
+
+/* Save / restore the callee-saved FP control state (MXCSR, x87 control word),
+ * which sigsetjmp does not keep. */
+static inline void fpu_ctl_save(thread_ctx_t *ctx)
+{
+    __asm__ volatile ("stmxcsr %0\n"
+                      "fnstcw %1\n"
+                      : "=m"(ctx->mxcsr), "=m"(ctx->fpu_cw));
+}
+
+static inline void fpu_ctl_restore(const thread_ctx_t *ctx)
+{
+    __asm__ volatile ("ldmxcsr %0\n"
+                      "fldcw %1\n"
+                      :
+                      : "m"(ctx->mxcsr), "m"(ctx->fpu_cw));
+}
+
 
 
 
@@ -35,9 +80,41 @@ static address_t translate_address(address_t addr)
 /* --------------------------------------------------------------- */
 
 
-static thread_t threads[MAX_THREAD_NUM]; //TCB table
+static thread_t threads[MAX_THREAD_NUM]; //TCB table (hot: scanned by the scheduler)
+static thread_ctx_t thread_ctx[MAX_THREAD_NUM]; //register contexts (cold: touched only on a switch)
 static char __attribute__((aligned(0x10))) thread_stacks[MAX_THREAD_NUM][STACK_SIZE];
 
+/* Stacks of UTHREAD_FPU threads: allocated the first time a slot needs one and
+ * reused afterwards, since a thread terminating itself still runs on it. */
+static char *fpu_stacks[MAX_THREAD_NUM];
+static size_t fpu_stack_bytes = 0;
+
+/* Shared run stack of UTHREAD_SHARED_STACK threads. shared_owner's frames are
+ * on it; they are only copied out when another shared-stack thread is about
+ * to run, which restore_shared_stack() does from restore_ctx, a context on
+ * switch_stack, so that it never overwrites the stack it is running on.     */
+static char __attribute__((aligned(64))) shared_stack[SHARED_STACK_SIZE];
+static char __attribute__((aligned(0x10))) switch_stack[STACK_SIZE];
+static int shared_owner = -1;
+static int restore_tid = -1;
+static sigjmp_buf restore_ctx;
+
+/* Scheduler stack: work too deep for a STACK_SIZE thread stack, such as task
+ * steps, runs here through sched_call() instead of on the stack of whichever
+ * thread is being switched out. sched_ctx enters it fresh each time and
+ * sched_return comes back; SIGVTALRM stays masked in between.             */
+static char __attribute__((aligned(0x10))) sched_stack[SCHED_STACK_SIZE];
+static sigjmp_buf sched_ctx;
+static sigjmp_buf sched_return;
+static void (*sched_fn)(void *);
+static void *sched_arg;
+static int sched_ready = 0;      /* sched_ctx set up (uthread_init ran) */
+static int on_sched_stack = 0;
+
+/* Context captured once in uthread_init (empty signal mask); new threads copy
+ * it and patch SP/PC instead of calling sigsetjmp, which is a syscall. */
+static sigjmp_buf ctx_template;
+
 
 unsigned long total_quantums = 0;
 int quantum_usec = 0;
@@ -48,6 +125,220 @@ int current_tid = 0; //current thread running
 int num_threads = 0;
 int_queue_t ready_q;
 
+/* Stackless tasks: task_table[id - MAX_THREAD_NUM], grown on demand. Released
+ * IDs are kept on a free list. Sleeping tasks sit in a list sorted by wake-up
+ * quantum, so waking them costs nothing while none is due.               */
+static uthread_task_t **task_table = NULL;
+static int task_table_cap = 0;
+static int task_table_len = 0;
+static int *free_task_ids = NULL;
+static int num_free_task_ids = 0;
+static uthread_task_t *task_sleepers = NULL;
+
+/* READY tasks: an unbounded FIFO linked through task->next, separate from
+ * the thread READY queue (whose capacity is sized for threads).          */
+static uthread_task_t *task_ready_head = NULL;
+static uthread_task_t *task_ready_tail = NULL;
+
+/* Blocking-call offload: helper kernel threads take jobs from a mutex-guarded
+ * FIFO and push finished jobs onto a lock-free stack that the scheduler drains.
+ * idle_sem is posted after every push so an idle scheduler can sleep on it. */
+#define OFFLOAD_THREADS 4
+
+typedef struct offload_job {
+    uthread_offload_fn fn;
+    void *arg;
+    void *result;
+    int tid;
+    struct offload_job *next;
+} offload_job_t;
+
+static pthread_mutex_t offload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t offload_cond = PTHREAD_COND_INITIALIZER;
+static offload_job_t *offload_head = NULL;          /* pending, FIFO */
+static offload_job_t *offload_tail = NULL;
+static _Atomic(offload_job_t *) offload_done = NULL; /* completed, LIFO */
+static int offload_started = 0;
+static sem_t idle_sem;
+
+/* Resumes posted from other kernel threads / signal handlers: one bit per
+ * tid, set with a single atomic OR and drained by the scheduler.        */
+#define INBOX_WORDS ((MAX_THREAD_NUM + 63) / 64)
+static _Atomic unsigned long resume_inbox[INBOX_WORDS];
+static atomic_int scheduler_idle = 0;   /* scheduler is sleeping in idle_wait */
+
+/* An async resume that found its thread not (yet) blocked leaves a permit,
+ * consumed by the thread's next self-block instead of blocking (park/unpark). */
+static unsigned char wake_permit[MAX_THREAD_NUM];
+
+/* CPU-quota thread groups. group_of[tid] is the thread's group or -1;
+ * usage counts quanta charged in the group's current period.         */
+typedef struct {
+    int used;
+    int parent;                 /* -1 for a top-level group */
+    int quota;
+    int period;
+    int usage;
+    unsigned long period_start;
+} group_t;
+
+static group_t groups[MAX_GROUP_NUM];
+static int num_groups = 0;
+static int group_of[MAX_THREAD_NUM];
+
+/* uthread_join: the thread each THREAD_WAIT_JOIN waiter is waiting for, and
+ * per-slot generations, bumped by every spawn, so a stale tid can be told
+ * from the thread that reused its slot.                                   */
+static int join_target[MAX_THREAD_NUM];
+static unsigned int thread_gen[MAX_THREAD_NUM];
+
+/* uthread_wait: THREAD_WAIT_FUTEX waiters, hashed by address into FIFO
+ * lists linked through wait_next[]; -1 ends a list.                  */
+#define WAIT_BUCKET_BITS 6
+#define WAIT_BUCKETS (1 << WAIT_BUCKET_BITS)
+
+static int wait_head[WAIT_BUCKETS];
+static int wait_tail[WAIT_BUCKETS];
+static int wait_next[MAX_THREAD_NUM];
+static const volatile int *wait_addr[MAX_THREAD_NUM];
+
+/* Scheduling-latency statistics: when each thread last became READY (ns and
+ * quantum), the quantum a woken sleeper was due, and the histograms; index
+ * MAX_THREAD_NUM of each histogram table is the global one.                */
+static unsigned long ready_since_ns[MAX_THREAD_NUM];
+static unsigned long ready_since_q[MAX_THREAD_NUM];
+static unsigned long wake_due_q[MAX_THREAD_NUM];       /* 0 if not woken from sleep */
+static int watchdog_reported[MAX_THREAD_NUM];
+static int watchdog_quantums = 0;
+static uthread_hist_t latency_hist[MAX_THREAD_NUM + 1];
+static uthread_hist_t lateness_hist[MAX_THREAD_NUM + 1];
+
+/* Shared-memory metrics (uthread_metrics_export). run_ns is private and
+ * copied into the segment; run_start_ns is when the current thread was
+ * dispatched, 0 while the scheduler itself runs (idle, task steps).    */
+static uthread_metrics_t *metrics = NULL;
+static char metrics_name[64];
+static unsigned long run_ns[MAX_THREAD_NUM];
+static unsigned long run_start_ns = 0;
+static unsigned long num_switches = 0;
+
+/* uthread_log: one single-producer ring per thread. The owning thread only
+ * advances tail and the scheduler (same kernel thread, SIGVTALRM masked) only
+ * advances head, so a thread preempted mid-append never corrupts a buffer. */
+#ifndef LOG_BUF_SIZE
+#define LOG_BUF_SIZE 1024   /* bytes per thread, power of two */
+#endif
+#define LOG_LINE_MAX 256
+
+typedef struct {
+    _Atomic size_t head;    /* next byte to write out */
+    _Atomic size_t tail;    /* next free byte */
+    char data[LOG_BUF_SIZE];
+} log_ring_t;
+
+static log_ring_t log_rings[MAX_THREAD_NUM];
+static atomic_int log_dirty = 0;
+
+/* Periodic real-time class (EDF). rt[tid].period == 0 means round robin;
+ * rt_tids lists the periodic threads so releases do not scan the table. */
+typedef struct {
+    int period;                 /* quantums between releases */
+    int budget;                 /* quantums per job */
+    int budget_left;            /* quantums left in the current job */
+    int job_done;               /* current job called uthread_wait_next_period */
+    int overruns;
+    unsigned long next_release; /* absolute quantum of the next release */
+    unsigned long deadline;     /* absolute deadline of the current job */
+} rt_params_t;
+
+static rt_params_t rt[MAX_THREAD_NUM];
+static int rt_tids[MAX_THREAD_NUM];
+static int num_rt = 0;
+static double rt_utilisation = 0.0;
+
+
+
+/* --------------------------------------------------------------- */
+/* READY transitions and latency statistics                        */
+/* --------------------------------------------------------------- */
+
+static inline unsigned long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);   /* vDSO, no syscall */
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Put a thread at the end of the READY queue and stamp when it got there. */
+static void make_ready(int tid)
+{
+    threads[tid].state = THREAD_READY;
+    queue_enqueue(&ready_q, tid);
+    ready_since_ns[tid] = now_ns();
+    ready_since_q[tid] = total_quantums;
+    watchdog_reported[tid] = 0;
+}
+
+static inline int hist_bucket(unsigned long v)
+{
+    if (v < (1UL << UTHREAD_HIST_SUB_BITS)) return (int)v;
+    int e = 63 - __builtin_clzl(v);
+    int shift = e - UTHREAD_HIST_SUB_BITS;
+    return ((shift + 1) << UTHREAD_HIST_SUB_BITS) |
+           (int)((v >> shift) & ((1UL << UTHREAD_HIST_SUB_BITS) - 1));
+}
+
+/* Largest value that falls in bucket b. */
+static unsigned long hist_bucket_max(int b)
+{
+    if (b < (1 << UTHREAD_HIST_SUB_BITS)) return (unsigned long)b;
+    int shift = (b >> UTHREAD_HIST_SUB_BITS) - 1;
+    unsigned long sub = (unsigned long)(b & ((1 << UTHREAD_HIST_SUB_BITS) - 1));
+    unsigned long base = ((1UL << UTHREAD_HIST_SUB_BITS) | sub) << shift;
+    return base + ((1UL << shift) - 1);
+}
+
+static inline void hist_record(uthread_hist_t *h, unsigned long v)
+{
+    ++h->buckets[hist_bucket(v)];
+    ++h->count;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+/* next is about to run: record how long it waited. */
+static void note_dispatch(int next)
+{
+    unsigned long waited = now_ns() - ready_since_ns[next];
+    hist_record(&latency_hist[next], waited);
+    hist_record(&latency_hist[MAX_THREAD_NUM], waited);
+
+    if (wake_due_q[next] != 0) {
+        unsigned long late = total_quantums - wake_due_q[next];
+        hist_record(&lateness_hist[next], late);
+        hist_record(&lateness_hist[MAX_THREAD_NUM], late);
+        wake_due_q[next] = 0;
+    }
+}
+
+/* Report threads READY for more than watchdog_quantums (once per wait).
+ * Uses write(2) as this runs inside the scheduler.                    */
+static void watchdog_scan(void)
+{
+    for (int i = 0; i < MAX_THREAD_NUM; ++i) {
+        if (threads[i].state == THREAD_READY && !watchdog_reported[i] &&
+            total_quantums - ready_since_q[i] > (unsigned long)watchdog_quantums) {
+            char msg[96];
+            int len = snprintf(msg, sizeof msg,
+                               "thread library warning: thread %d READY for %lu quantums\n",
+                               i, total_quantums - ready_since_q[i]);
+            if (write(STDERR_FILENO, msg, len) < 0) { /* nothing better to do */ }
+            watchdog_reported[i] = 1;
+        }
+    }
+}
+
+
 
 
 /* --------------------------------------------------------------- */
@@ -125,6 +416,192 @@ static inline void unmask_sigvtalrm(const sigset_t *old)
 
 
 
+/* --------------------------------------------------------------- */
+/* deterministic simulated-time mode                               */
+/* --------------------------------------------------------------- */
+
+/* In this mode no timer is armed: a quantum is a budget of uthread_tick()
+ * steps, drawn from a seeded xorshift64* generator (fixed when seed == 0),
+ * so the same seed replays the same schedule.                      */
+static int sim_mode = 0;
+static int sim_quantum_steps = 0;
+static int sim_steps_left = 0;
+static unsigned long sim_rng = 0;
+
+static int sim_next_budget(void)
+{
+    if (sim_rng == 0) {
+        return sim_quantum_steps;
+    }
+    sim_rng ^= sim_rng >> 12;
+    sim_rng ^= sim_rng << 25;
+    sim_rng ^= sim_rng >> 27;
+    return 1 + (int)((sim_rng * 0x2545F4914F6CDD1DUL) % (unsigned long)sim_quantum_steps);
+}
+
+
+/* --------------------------------------------------------------- */
+/* adaptive quantum                                                */
+/* --------------------------------------------------------------- */
+
+/* The cost of a switch is timed from schedule_next entry until the resumed
+ * thread is back in schedule_next; switches that idled or ran tasks inline
+ * are not sampled.                                                      */
+static int adaptive = 0;
+static int adapt_min_usec, adapt_max_usec, adapt_overhead_pct, adapt_rotation_usec;
+static unsigned long switch_cost_ns = 0;    /* EWMA, weight 1/8 per sample */
+static unsigned long switch_start_ns = 0;   /* 0: current switch not timed */
+
+static void sample_switch_cost(void)
+{
+    unsigned long cost = now_ns() - switch_start_ns;
+    switch_start_ns = 0;
+    if (switch_cost_ns == 0) switch_cost_ns = cost;
+    else switch_cost_ns += ((long)cost - (long)switch_cost_ns) / 8;
+}
+
+/* Longest quantum that still lets every runnable thread run within the
+ * rotation bound, but never so short that switching exceeds the overhead
+ * target; the timer is re-armed only on a change of more than 1/8.     */
+static void adapt_quantum(void)
+{
+    unsigned long runnable = ready_q.size + 1;
+    unsigned long q_cost = switch_cost_ns * 100 / adapt_overhead_pct / 1000;
+    unsigned long q_rot = adapt_rotation_usec / runnable;
+    unsigned long q = q_rot > q_cost ? q_rot : q_cost;
+
+    if (q < (unsigned long)adapt_min_usec) q = adapt_min_usec;
+    if (q > (unsigned long)adapt_max_usec) q = adapt_max_usec;
+
+    long diff = (long)q - quantum_usec;
+    if (diff < 0) diff = -diff;
+    if (diff * 8 > quantum_usec) {
+        quantum_usec = (int)q;
+        arm_virtual_timer();
+    }
+}
+
+
+
+
+/* --------------------------------------------------------------- */
+/* stack assignment                                                */
+/* --------------------------------------------------------------- */
+
+/* Fill the whole stack with the paint pattern and plant the canary. */
+static void paint_stack(int tid)
+{
+    memset(thread_ctx[tid].stack, STACK_PAINT, thread_ctx[tid].stack_size);
+    *(unsigned long *)thread_ctx[tid].stack = STACK_CANARY;
+}
+
+/* Fail fast if the thread ran past the base of its stack. */
+static inline void check_stack_canary(int tid)
+{
+    if (thread_ctx[tid].stack != NULL &&
+        *(const unsigned long *)thread_ctx[tid].stack != STACK_CANARY) {
+        fprintf(stderr, "thread library error: stack overflow in thread %d "
+                "(stack size %zu bytes)\n", tid, thread_ctx[tid].stack_size);
+        exit(1);
+    }
+}
+
+/* Entered fresh on sched_stack by sched_call(): run the call, then return. */
+static void sched_trampoline(void)
+{
+    sched_fn(sched_arg);
+    if (*(const unsigned long *)sched_stack != STACK_CANARY) {
+        fprintf(stderr, "thread library error: scheduler stack overflow "
+                "(stack size %d bytes)\n", SCHED_STACK_SIZE);
+        exit(1);
+    }
+    siglongjmp(sched_return, 1);
+}
+
+/* Run fn(arg) on the scheduler stack; SIGVTALRM is masked by the caller.
+ * Calls made while already on it (or before uthread_init) run in place. */
+static void sched_call(void (*fn)(void *), void *arg)
+{
+    if (on_sched_stack || !sched_ready) {
+        fn(arg);
+        return;
+    }
+    sched_fn = fn;
+    sched_arg = arg;
+    on_sched_stack = 1;
+    if (sigsetjmp(sched_return, 0) == 0) {
+        siglongjmp(sched_ctx, 1);
+    }
+    on_sched_stack = 0;
+}
+
+/* Drop tid's claim on the shared run stack and its saved copy of it. */
+static void release_shared_stack(int tid)
+{
+    free(thread_ctx[tid].saved_stack);
+    thread_ctx[tid].saved_stack = NULL;
+    thread_ctx[tid].saved_len = 0;
+    thread_ctx[tid].saved_cap = 0;
+    if (shared_owner == tid) shared_owner = -1;
+}
+
+/* Point thread_ctx[tid] at the stack it will run on. Integer-only threads
+ * use the static STACK_SIZE slot; UTHREAD_FPU threads get a larger stack,
+ * because on preemption the kernel pushes a signal frame holding the full
+ * extended register state onto the interrupted thread's stack, and that
+ * frame (several KiB with AVX-512) does not fit in STACK_SIZE.            */
+static void assign_stack(int tid, int flags)
+{
+    if (flags & UTHREAD_SHARED_STACK) {
+        /* painted (with its canary) once in uthread_init, never per thread */
+        thread_ctx[tid].stack = shared_stack;
+        thread_ctx[tid].stack_size = SHARED_STACK_SIZE;
+        thread_ctx[tid].saved_len = 0;
+        thread_ctx[tid].saved_peak = 0;
+        if (shared_owner == tid) shared_owner = -1;
+        return;
+    }
+
+    /* the slot may have belonged to a shared-stack thread */
+    release_shared_stack(tid);
+
+    if (!(flags & UTHREAD_FPU)) {
+        thread_ctx[tid].stack = thread_stacks[tid];
+        thread_ctx[tid].stack_size = STACK_SIZE;
+        paint_stack(tid);
+        return;
+    }
+
+    if (fpu_stack_bytes == 0) {
+        size_t frame = getauxval(AT_MINSIGSTKSZ);
+        if (frame < (size_t)SIGSTKSZ) frame = SIGSTKSZ;
+        fpu_stack_bytes = (STACK_SIZE + frame + 63) & ~(size_t)63;
+    }
+
+    if (fpu_stacks[tid] == NULL) {
+        fpu_stacks[tid] = aligned_alloc(64, fpu_stack_bytes);
+        if (fpu_stacks[tid] == NULL) {
+            fprintf(stderr, "system error: stack allocation failed\n");
+            exit(1);
+        }
+    }
+    thread_ctx[tid].stack = fpu_stacks[tid];
+    thread_ctx[tid].stack_size = fpu_stack_bytes;
+    paint_stack(tid);
+}
+
+
+
+static int init_library(void);
+static int task_resume(int id);
+static void rt_clear(int tid);
+static void resume_thread(int tid);
+static void log_flush_locked(void);
+static void restore_shared_stack(void);
+static void switch_threads(int prev, int next);
+static void dispatch(int prev, int next);
+static void wait_unlink(int tid);
+
 int uthread_init(int quantum_usecs)
 {
     /* Input validation --------------------------------------------------- */
@@ -140,22 +617,68 @@ int uthread_init(int quantum_usecs)
     }
 
     quantum_usec = quantum_usecs;
+
+    return init_library();
+}
+
+int uthread_init_deterministic(int quantum_steps, unsigned long seed)
+{
+    /* Input validation --------------------------------------------------- */
+    if (quantum_steps <= 0) {
+        fprintf(stderr, "thread library error: quantum_steps must be positive\n");
+        return -1;
+    }
+
+    /* Prevent multiple initialisations ----------------------------------- */
+    if (num_threads != 0) {
+        fprintf(stderr, "thread library error: uthread_init may be called only once\n");
+        return -1;
+    }
+
+    sim_mode = 1;
+    sim_quantum_steps = quantum_steps;
+    sim_rng = seed;
+    sim_steps_left = sim_next_budget();
+
+    return init_library();
+}
+
+/* Shared tail of uthread_init / uthread_init_deterministic. */
+static int init_library(void)
+{
     total_quantums = 1;
     num_threads = 1;
 
     init_mask();
-    install_timer_handler();
 
+    for (int i = 0; i < WAIT_BUCKETS; ++i) {
+        wait_head[i] = wait_tail[i] = -1;
+    }
+
+    if (sem_init(&idle_sem, 0, 0) == -1) {
+        fprintf(stderr, "system error: sem_init failed\n");
+        exit(1);
+    }
+
+    /* whatever uthread_log buffered is written out on every exit path */
+    atexit(uthread_log_flush);
+
+    if (!sim_mode) {
+        install_timer_handler();
 
-    // Configure virtual timer
-    arm_virtual_timer();
+        // Configure virtual timer
+        arm_virtual_timer();
+    }
 
     //initialize main thread
     threads[0].tid = 0;
     threads[0].state = THREAD_RUNNING;
     threads[0].quantums = 1;
     threads[0].sleep_until = 0;
-    threads[0].entry = NULL; // Main thread has no entry point
+    thread_ctx[0].entry = NULL; // Main thread has no entry point
+    thread_ctx[0].stack = NULL; // Main thread runs on the process stack
+    thread_ctx[0].stack_size = 0;
+    thread_ctx[0].flags = 0;
     current_tid = 0;
 
 
@@ -167,21 +690,49 @@ int uthread_init(int quantum_usecs)
 
   
 
-    sigsetjmp(threads[0].env, 1);
-    threads[0].env->__jmpbuf[JB_SP] = translate_address(sp);
-    threads[0].env->__jmpbuf[JB_PC] = translate_address((address_t)NULL); // Main thread doesn't need PC
+    sigsetjmp(thread_ctx[0].env, 1);
+    thread_ctx[0].env->__jmpbuf[JB_SP] = translate_address(sp);
+    thread_ctx[0].env->__jmpbuf[JB_PC] = translate_address((address_t)NULL); // Main thread doesn't need PC
 
 
     // Clear signal mask for main thread
-    sigemptyset(&threads[0].env->__saved_mask);
+    sigemptyset(&thread_ctx[0].env->__saved_mask);
+
+    // Template for new threads' contexts
+    sigsetjmp(ctx_template, 1);
+    sigemptyset(&ctx_template->__saved_mask);
    
 
     /* Clear per‑thread tables ------------------------------------------- */
     for (int i = 1; i < MAX_THREAD_NUM; ++i) {
-        memset(thread_stacks[i], 0, STACK_SIZE);
-        threads[i].state = THREAD_UNUSED;
+        threads[i].state = THREAD_UNUSED;   /* stacks are painted on spawn */
+    }
+    for (int i = 0; i < MAX_THREAD_NUM; ++i) {
+        group_of[i] = -1;
     }
 
+    /* Shared run stack and the context that refills it ----------------- */
+    memset(shared_stack, STACK_PAINT, SHARED_STACK_SIZE);
+    *(unsigned long *)shared_stack = STACK_CANARY;
+
+    address_t rsp = (address_t)(switch_stack + STACK_SIZE);
+    rsp = (rsp & ~0xF) - sizeof(address_t);
+    memcpy(restore_ctx, ctx_template, sizeof(sigjmp_buf));
+    restore_ctx->__jmpbuf[JB_SP] = translate_address(rsp);
+    restore_ctx->__jmpbuf[JB_PC] = translate_address((address_t)restore_shared_stack);
+    restore_ctx->__saved_mask = vt_set;   /* runs with SIGVTALRM masked */
+
+    /* Scheduler stack and the context that enters it ------------------- */
+    *(unsigned long *)sched_stack = STACK_CANARY;
+    rsp = (address_t)(sched_stack + SCHED_STACK_SIZE);
+    rsp = (rsp & ~0xF) - sizeof(address_t);
+    *(address_t *)rsp = 0;                /* end of the frame chain */
+    memcpy(sched_ctx, ctx_template, sizeof(sigjmp_buf));
+    sched_ctx->__jmpbuf[JB_SP] = translate_address(rsp);
+    sched_ctx->__jmpbuf[JB_PC] = translate_address((address_t)sched_trampoline);
+    sched_ctx->__mask_was_saved = 0;      /* mask is already right: no syscall */
+    sched_ready = 1;
+
     
     /* Ready‑queue initialisation ---------------------------------------- */
     queue_init(&ready_q);
@@ -190,7 +741,36 @@ int uthread_init(int quantum_usecs)
     return 0;
 }
 
+/* Fill in the TCB, stack and initial context of a new thread in slot tid.
+ * The caller holds SIGVTALRM masked and enqueues the thread. */
+static void init_thread(int tid, thread_entry_point entry_point, int flags)
+{
+    assign_stack(tid, flags);
+
+    threads[tid].tid = tid;
+    threads[tid].state = THREAD_READY;
+    threads[tid].quantums = 0;
+    threads[tid].sleep_until = 0;
+    thread_ctx[tid].entry = entry_point;
+    thread_ctx[tid].flags = flags;
+    thread_ctx[tid].wait = THREAD_WAIT_NONE;
+    thread_ctx[tid].offload_job = NULL;
+    group_of[tid] = -1;
+    wake_due_q[tid] = 0;
+    run_ns[tid] = 0;
+    wake_permit[tid] = 0;
+    ++thread_gen[tid];
+    memset(&latency_hist[tid], 0, sizeof latency_hist[tid]);
+    memset(&lateness_hist[tid], 0, sizeof lateness_hist[tid]);
+    setup_thread(tid, thread_ctx[tid].stack, entry_point);
+}
+
 int uthread_spawn(thread_entry_point entry_point)
+{
+    return uthread_spawn_ex(entry_point, 0);
+}
+
+int uthread_spawn_ex(thread_entry_point entry_point, int flags)
 {
 
     sigset_t old;
@@ -202,6 +782,11 @@ int uthread_spawn(thread_entry_point entry_point)
         return -1;
 
     }
+    if (flags & ~(UTHREAD_FPU | UTHREAD_SHARED_STACK)) {
+        fprintf(stderr, "thread library error: invalid spawn flags\n");
+        unmask_sigvtalrm(&old);
+        return -1;
+    }
     if (num_threads >= MAX_THREAD_NUM) {
         fprintf(stderr, "thread library error: too many threads\n");
         unmask_sigvtalrm(&old);
@@ -223,25 +808,111 @@ int uthread_spawn(thread_entry_point entry_point)
         unmask_sigvtalrm(&old);
         return -1;
     }
-        
-    threads[availableId].tid = availableId;
-    threads[availableId].state = THREAD_READY;
-    threads[availableId].quantums = 0;
-    threads[availableId].sleep_until = 0;
-    threads[availableId].entry = entry_point;
 
-    setup_thread(availableId, thread_stacks[availableId], entry_point);
+    init_thread(availableId, entry_point, flags);
 
     
     ++num_threads;
 
-    queue_enqueue(&ready_q, availableId);
+    make_ready(availableId);
 
     unmask_sigvtalrm(&old);
 
     return availableId;
 }
 
+/* Entry point of uthread_spawn_closure threads. */
+static void closure_trampoline(void)
+{
+    thread_ctx_t *ctx = &thread_ctx[current_tid];
+    ctx->closure_invoke(ctx->closure);
+    uthread_terminate(current_tid);
+}
+
+int uthread_spawn_closure(void (*invoke)(void *), void (*construct)(void *, void *),
+                          void *src, size_t size, int flags, unsigned int *gen_out)
+{
+    if (invoke == NULL || construct == NULL) {
+        fprintf(stderr, "thread library error: entry_point is NULL\n");
+        return -1;
+    }
+    if (size > UTHREAD_CLOSURE_SIZE) {
+        fprintf(stderr, "thread library error: closure too large\n");
+        return -1;
+    }
+
+    /* the thread cannot run before its closure is in place */
+    sigset_t old;
+    mask_sigvtalrm(&old);
+    int tid = uthread_spawn_ex(closure_trampoline, flags);
+    if (tid >= 0) {
+        thread_ctx[tid].closure_invoke = invoke;
+        construct(thread_ctx[tid].closure, src);
+        if (gen_out != NULL) *gen_out = thread_gen[tid];
+    }
+    unmask_sigvtalrm(&old);
+    return tid;
+}
+
+int uthread_spawn_many(const thread_entry_point entries[], int n, int tids_out[])
+{
+
+    if (entries == NULL || n <= 0) {
+        fprintf(stderr, "thread library error: invalid spawn batch\n");
+        return -1;
+    }
+    for (int k = 0; k < n; ++k) {
+        if (entries[k] == NULL) {
+            fprintf(stderr, "thread library error: entry_point is NULL\n");
+            return -1;
+        }
+    }
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+
+    if (num_threads + n > MAX_THREAD_NUM) {
+        fprintf(stderr, "thread library error: too many threads\n");
+        unmask_sigvtalrm(&old);
+        return -1;
+    }
+
+    /* one pass over the table hands out all the IDs */
+    int batch[MAX_THREAD_NUM];
+    int k = 0;
+    for (int i = 1; i < MAX_THREAD_NUM && k < n; i++) {
+        if (threads[i].state == THREAD_UNUSED ||
+            threads[i].state == THREAD_TERMINATED) {
+            init_thread(i, entries[k], 0);
+            batch[k++] = i;
+        }
+    }
+
+    /* append the whole batch to the ready queue in spawn order */
+    for (k = 0; k < n; ++k) {
+        make_ready(batch[k]);
+        if (tids_out != NULL) tids_out[k] = batch[k];
+    }
+
+    num_threads += n;
+
+    unmask_sigvtalrm(&old);
+
+    return 0;
+}
+
+/* Ready every thread waiting in uthread_join for tid. */
+static void wake_joiners(int tid)
+{
+    for (int i = 0; i < MAX_THREAD_NUM; ++i) {
+        if (threads[i].state == THREAD_BLOCKED &&
+            thread_ctx[i].wait == THREAD_WAIT_JOIN && join_target[i] == tid) {
+            thread_ctx[i].wait = THREAD_WAIT_NONE;
+            resume_thread(i);
+        }
+    }
+}
+
 int uthread_terminate(int tid)
 {
 
@@ -270,10 +941,12 @@ int uthread_terminate(int tid)
                 threads[i].state = THREAD_TERMINATED;
                 num_threads--;
             
-                threads[i].entry = NULL;
+                thread_ctx[i].entry = NULL;
+                thread_ctx[i].offload_job = NULL;
             
-                // get the corresponding stack in the stacks table and zero it
-                memset(thread_stacks[i], 0, sizeof thread_stacks[i]);
+                // zero the thread's stack
+                if (thread_ctx[i].stack != NULL && !(thread_ctx[i].flags & UTHREAD_SHARED_STACK))
+                    memset(thread_ctx[i].stack, 0, thread_ctx[i].stack_size);
             }
             
         }
@@ -294,8 +967,12 @@ int uthread_terminate(int tid)
     //the running thread terminates itself
     if(tid == current_tid){
 
+        rt_clear(tid);
         threads[tid].state = THREAD_TERMINATED;
         num_threads--;
+        wake_joiners(tid);
+        // still running on the shared stack, but nothing of it needs saving
+        if (thread_ctx[tid].flags & UTHREAD_SHARED_STACK) release_shared_stack(tid);
         unmask_sigvtalrm(&old);
         
         //if no more running threads
@@ -314,13 +991,21 @@ int uthread_terminate(int tid)
     //remove from queue if it is in ready state
     if(threads[tid].state == THREAD_READY) queue_delete(&ready_q, tid);
 
+        rt_clear(tid);
+        if (thread_ctx[tid].wait == THREAD_WAIT_FUTEX) wait_unlink(tid);
         threads[tid].state = THREAD_TERMINATED;
         num_threads--;
+        wake_joiners(tid);
        
-        threads[tid].entry = NULL;
+        thread_ctx[tid].entry = NULL;
+        thread_ctx[tid].offload_job = NULL;
        
-        // get the corresponding stack in the stacks table and zero it
-        memset(thread_stacks[tid], 0, sizeof thread_stacks[tid]);
+        // zero the thread's stack, or drop its copy of the shared one
+        if (thread_ctx[tid].flags & UTHREAD_SHARED_STACK) {
+            release_shared_stack(tid);
+        } else {
+            memset(thread_ctx[tid].stack, 0, thread_ctx[tid].stack_size);
+        }
 
 
     unmask_sigvtalrm(&old);
@@ -331,143 +1016,1584 @@ int uthread_terminate(int tid)
 
 
 
-int uthread_block(int tid) {
-
-    /* input validation */
-    if (tid < 0 || tid >= MAX_THREAD_NUM) {
+int uthread_join(int tid)
+{
+    if (tid <= 0 || tid >= MAX_THREAD_NUM) {
         fprintf(stderr, "thread library error: invalid tid\n");
         return -1;
     }
-    if (tid == 0) {
-        fprintf(stderr, "thread library error: cannot block main thread\n");
-        return -1;
-    }
-    if (threads[tid].state == THREAD_UNUSED ||
-        threads[tid].state == THREAD_TERMINATED) {
+    return uthread_join_generation(tid, thread_gen[tid]);
+}
+
+unsigned int uthread_get_generation(int tid)
+{
+    if (tid < 0 || tid >= MAX_THREAD_NUM) return 0;
+    return thread_gen[tid];
+}
+
+int uthread_join_generation(int tid, unsigned int gen)
+{
+    if (tid <= 0 || tid >= MAX_THREAD_NUM || tid == current_tid) {
         fprintf(stderr, "thread library error: invalid tid\n");
         return -1;
     }
-    
 
     sigset_t old;
     mask_sigvtalrm(&old);
 
-    //currently running thread blocking itself
-    if(current_tid == tid){
+    if (thread_gen[tid] == gen &&
+        threads[tid].state != THREAD_UNUSED &&
+        threads[tid].state != THREAD_TERMINATED) {
+        join_target[current_tid] = tid;
+        thread_ctx[current_tid].wait = THREAD_WAIT_JOIN;
         threads[current_tid].state = THREAD_BLOCKED;
-        schedule_next();
-
-        
-    }
-    else{
-    //running thread blocking another thread
-    if(threads[tid].state == THREAD_READY)queue_delete(&ready_q, tid);
-
-    threads[tid].state = THREAD_BLOCKED;
+        schedule_next();   /* back here once wake_joiners readied us */
     }
-  
 
     unmask_sigvtalrm(&old);
     return 0;
 }
 
+void uthread_yield(void)
+{
+    schedule_next();
+}
 
-int uthread_resume(int tid){
+static inline unsigned int wait_bucket(const volatile int *addr)
+{
+    return (unsigned int)(((unsigned long)addr * 0x9E3779B97F4A7C15UL) >> (64 - WAIT_BUCKET_BITS));
+}
 
-    if (tid < 0 || tid >= MAX_THREAD_NUM) {
-        fprintf(stderr, "thread library error: invalid tid\n");
+/* Take a THREAD_WAIT_FUTEX waiter off its list (it is terminating). */
+static void wait_unlink(int tid)
+{
+    unsigned int b = wait_bucket(wait_addr[tid]);
+    int prev = -1;
+    for (int i = wait_head[b]; i != -1; prev = i, i = wait_next[i]) {
+        if (i != tid) continue;
+        if (prev == -1) wait_head[b] = wait_next[i];
+        else wait_next[prev] = wait_next[i];
+        if (wait_tail[b] == i) wait_tail[b] = prev;
+        return;
+    }
+}
+
+int uthread_wait(const volatile int *addr, int expected)
+{
+    if (addr == NULL) {
+        fprintf(stderr, "thread library error: invalid wait address\n");
         return -1;
     }
 
     sigset_t old;
     mask_sigvtalrm(&old);
 
-
-    if (threads[tid].state == THREAD_UNUSED ||
-        threads[tid].state == THREAD_TERMINATED) {
-        fprintf(stderr, "thread library error: invalid tid\n");
+    /* no uthread can change *addr between this check and parking */
+    if (*addr != expected) {
         unmask_sigvtalrm(&old);
-        return -1;
+        return 1;
     }
-    
 
+    unsigned int b = wait_bucket(addr);
+    wait_addr[current_tid] = addr;
+    wait_next[current_tid] = -1;
+    if (wait_tail[b] == -1) wait_head[b] = current_tid;
+    else wait_next[wait_tail[b]] = current_tid;
+    wait_tail[b] = current_tid;
 
-    if(threads[tid].state == THREAD_READY ||threads[tid].state == THREAD_RUNNING){
-        unmask_sigvtalrm(&old);
-        return 0;
+    thread_ctx[current_tid].wait = THREAD_WAIT_FUTEX;
+    threads[current_tid].state = THREAD_BLOCKED;
+    schedule_next();   /* back here once uthread_wake readied us */
+
+    unmask_sigvtalrm(&old);
+    return 0;
+}
+
+int uthread_wake(const volatile int *addr, int n)
+{
+    if (addr == NULL || n < 0) {
+        fprintf(stderr, "thread library error: invalid wake request\n");
+        return -1;
+    }
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+
+    unsigned int b = wait_bucket(addr);
+    int woken = 0;
+    int prev = -1;
+    int i = wait_head[b];
+    while (i != -1 && woken < n) {
+        int next = wait_next[i];
+        if (wait_addr[i] != addr) {
+            prev = i;
+            i = next;
+            continue;
+        }
+        if (prev == -1) wait_head[b] = next;
+        else wait_next[prev] = next;
+        if (wait_tail[b] == i) wait_tail[b] = prev;
+
+        thread_ctx[i].wait = THREAD_WAIT_NONE;
+        resume_thread(i);
+        ++woken;
+        i = next;
+    }
+
+    unmask_sigvtalrm(&old);
+    return woken;
+}
+
+int uthread_block(int tid) {
+
+    /* input validation */
+    if (tid < 0 || tid >= MAX_THREAD_NUM) {
+        fprintf(stderr, "thread library error: invalid tid\n");
+        return -1;
+    }
+    if (tid == 0) {
+        fprintf(stderr, "thread library error: cannot block main thread\n");
+        return -1;
+    }
+    if (threads[tid].state == THREAD_UNUSED ||
+        threads[tid].state == THREAD_TERMINATED) {
+        fprintf(stderr, "thread library error: invalid tid\n");
+        return -1;
+    }
+    
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+
+    //currently running thread blocking itself
+    if(current_tid == tid){
+        if (wake_permit[tid]) {
+            wake_permit[tid] = 0;   /* an async resume already came in */
+            unmask_sigvtalrm(&old);
+            return 0;
+        }
+        threads[current_tid].state = THREAD_BLOCKED;
+        schedule_next();
+
+        
+    }
+    else{
+    //running thread blocking another thread
+    if(threads[tid].state == THREAD_READY)queue_delete(&ready_q, tid);
+
+    threads[tid].state = THREAD_BLOCKED;
+    }
+  
+
+    unmask_sigvtalrm(&old);
+    return 0;
+}
+
+
+int uthread_resume(int tid){
+
+    if (tid < 0) {
+        fprintf(stderr, "thread library error: invalid tid\n");
+        return -1;
+    }
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+
+    if (tid >= MAX_THREAD_NUM) {
+        int ret = task_resume(tid);
+        unmask_sigvtalrm(&old);
+        return ret;
+    }
+
+
+    if (threads[tid].state == THREAD_UNUSED ||
+        threads[tid].state == THREAD_TERMINATED) {
+        fprintf(stderr, "thread library error: invalid tid\n");
+        unmask_sigvtalrm(&old);
+        return -1;
+    }
+    
+
+
+    if(threads[tid].state == THREAD_READY ||threads[tid].state == THREAD_RUNNING){
+        unmask_sigvtalrm(&old);
+        return 0;
+    }
+
+    /*only resume blocked threads that have sleep_until = 0 
+    we cant resume a sleeping thread as it is still blocked*/
+
+    resume_thread(tid);
+
+    unmask_sigvtalrm(&old);
+    return 0;
+
+}
+
+
+/* Common part of uthread_switch_to / uthread_block_and_switch_to. */
+static int direct_switch(int tid, int block_self)
+{
+    if (tid < 0 || tid >= MAX_THREAD_NUM || tid == current_tid) {
+        fprintf(stderr, "thread library error: invalid tid\n");
+        return -1;
+    }
+    if (block_self && current_tid == 0) {
+        fprintf(stderr, "thread library error: cannot block main thread\n");
+        return -1;
+    }
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+
+    int was_ready = (threads[tid].state == THREAD_READY);
+    int resumable = (threads[tid].state == THREAD_BLOCKED &&
+                     threads[tid].sleep_until == 0 &&
+                     thread_ctx[tid].wait == THREAD_WAIT_NONE);
+    if (!was_ready && !resumable) {
+        fprintf(stderr, "thread library error: thread cannot be switched to\n");
+        unmask_sigvtalrm(&old);
+        return -1;
+    }
+
+    int prev = current_tid;
+    check_stack_canary(prev);
+
+    if (block_self && wake_permit[prev]) {
+        wake_permit[prev] = 0;   /* already resumed asynchronously: just hand off */
+        block_self = 0;
+    }
+    if (was_ready) {
+        queue_delete(&ready_q, tid);
+        note_dispatch(tid);
+    }
+    if (block_self) {
+        threads[prev].state = THREAD_BLOCKED;
+    } else {
+        make_ready(prev);
+    }
+
+    /* the rest of the quantum is donated: no quantum accounting, timer untouched */
+    switch_start_ns = 0;
+    dispatch(prev, tid);
+
+    unmask_sigvtalrm(&old);
+    return 0;
+}
+
+int uthread_switch_to(int tid){
+    return direct_switch(tid, 0);
+}
+
+int uthread_block_and_switch_to(int tid){
+    return direct_switch(tid, 1);
+}
+
+
+int uthread_sleep(int num_quantums){
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+
+
+    /* main thread cannot sleep and num_quantums must be positive */
+    if (current_tid == 0 || num_quantums <= 0) {
+        fprintf(stderr, "thread library error: invalid sleep request\n");
+        unmask_sigvtalrm(&old);
+        return -1;
+    }
+   
+
+    //make it sleep until total quantums reaches a certain number
+    threads[current_tid].sleep_until = total_quantums + num_quantums;
+
+    threads[current_tid].state = THREAD_BLOCKED;
+    // /* context-switch to the next READY thread
+    // The call never returns until this thread is awakened by timer_handler()*/
+   
+    unmask_sigvtalrm(&old);
+    schedule_next();                    /* keeps SIGVTALRM blocked */
+   
+    // //resume here only after sleep expires
+    
+    return 0;
+    
+}
+
+
+
+
+static void rt_clear(int tid)
+{
+    if (rt[tid].period == 0) return;
+
+    rt_utilisation -= (double)rt[tid].budget / rt[tid].period;
+    for (int k = 0; k < num_rt; ++k) {
+        if (rt_tids[k] == tid) {
+            rt_tids[k] = rt_tids[--num_rt];
+            break;
+        }
+    }
+    if (thread_ctx[tid].wait == THREAD_WAIT_PERIOD) {
+        thread_ctx[tid].wait = THREAD_WAIT_NONE;
+    }
+    rt[tid].period = 0;
+}
+
+int uthread_set_periodic(int tid, int period, int budget){
+
+    if (tid < 0 || tid >= MAX_THREAD_NUM ||
+        threads[tid].state == THREAD_UNUSED ||
+        threads[tid].state == THREAD_TERMINATED) {
+        fprintf(stderr, "thread library error: invalid tid\n");
+        return -1;
+    }
+    if (period < 0 || (period > 0 && (budget <= 0 || budget > period))) {
+        fprintf(stderr, "thread library error: invalid period or budget\n");
+        return -1;
+    }
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+
+    double others = rt_utilisation;
+    if (rt[tid].period > 0) others -= (double)rt[tid].budget / rt[tid].period;
+
+    if (period > 0 && others + (double)budget / period > 1.0 + 1e-9) {
+        fprintf(stderr, "thread library error: periodic set not schedulable\n");
+        unmask_sigvtalrm(&old);
+        return -1;
+    }
+
+    int parked = (thread_ctx[tid].wait == THREAD_WAIT_PERIOD);
+    rt_clear(tid);
+    if (period > 0) {
+        rt[tid].period = period;
+        rt[tid].budget = budget;
+        rt[tid].budget_left = budget;
+        rt[tid].job_done = parked;
+        rt[tid].overruns = 0;
+        rt[tid].next_release = total_quantums + period;
+        rt[tid].deadline = rt[tid].next_release;
+        rt_tids[num_rt++] = tid;
+        rt_utilisation = others + (double)budget / period;
+        /* parked in uthread_wait_next_period: stays so until the new first release */
+        if (parked) thread_ctx[tid].wait = THREAD_WAIT_PERIOD;
+    } else if (parked) {
+        resume_thread(tid);   /* no longer periodic: nothing left to wait for */
+    }
+
+    unmask_sigvtalrm(&old);
+    return 0;
+}
+
+
+int uthread_wait_next_period(void){
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+
+    if (rt[current_tid].period == 0) {
+        fprintf(stderr, "thread library error: thread is not periodic\n");
+        unmask_sigvtalrm(&old);
+        return -1;
+    }
+
+    rt[current_tid].job_done = 1;
+    thread_ctx[current_tid].wait = THREAD_WAIT_PERIOD;
+    threads[current_tid].state = THREAD_BLOCKED;
+    schedule_next();   /* back here at the next release */
+
+    unmask_sigvtalrm(&old);
+    return 0;
+}
+
+
+int uthread_get_overruns(int tid){
+
+    if (tid < 0 || tid >= MAX_THREAD_NUM || rt[tid].period == 0 ||
+        threads[tid].state == THREAD_UNUSED ||
+        threads[tid].state == THREAD_TERMINATED) {
+        fprintf(stderr, "thread library error: invalid tid\n");
+        return -1;
+    }
+    return rt[tid].overruns;
+}
+
+
+int uthread_get_tid(){
+
+    return current_tid;
+}
+
+
+
+int uthread_set_adaptive(int min_usecs, int max_usecs,
+                         int target_overhead_pct, int max_rotation_usecs)
+{
+    if (sim_mode) {
+        fprintf(stderr, "thread library error: no adaptive quantum in deterministic mode\n");
+        return -1;
+    }
+    if (min_usecs == 0 && max_usecs == 0) {
+        adaptive = 0;   /* keep the current quantum */
+        return 0;
+    }
+    if (min_usecs <= 0 || max_usecs < min_usecs ||
+        target_overhead_pct <= 0 || target_overhead_pct >= 100 ||
+        max_rotation_usecs <= 0) {
+        fprintf(stderr, "thread library error: invalid adaptive quantum bounds\n");
+        return -1;
+    }
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+    adapt_min_usec = min_usecs;
+    adapt_max_usec = max_usecs;
+    adapt_overhead_pct = target_overhead_pct;
+    adapt_rotation_usec = max_rotation_usecs;
+    adaptive = 1;
+    unmask_sigvtalrm(&old);
+    return 0;
+}
+
+int uthread_get_quantum_usecs(void)
+{
+    return quantum_usec;
+}
+
+int uthread_get_total_quantums(){
+
+    return total_quantums;
+
+}
+
+
+int uthread_get_quantums(int tid){
+
+    if (tid < 0 || tid >= MAX_THREAD_NUM ||
+    threads[tid].state == THREAD_UNUSED ||
+    threads[tid].state == THREAD_TERMINATED) {
+    fprintf(stderr, "thread library error: invalid tid\n");
+    return -1;
+    }
+    return threads[tid].quantums;
+
+}
+
+
+int uthread_stack_usage(int tid){
+
+    if (tid <= 0 || tid >= MAX_THREAD_NUM ||
+    threads[tid].state == THREAD_UNUSED ||
+    threads[tid].state == THREAD_TERMINATED) {
+    fprintf(stderr, "thread library error: invalid tid\n");
+    return -1;
+    }
+
+    if (thread_ctx[tid].flags & UTHREAD_SHARED_STACK) {
+        return (int)thread_ctx[tid].saved_peak;
+    }
+
+    /* scan up from just above the canary to the first overwritten byte */
+    const unsigned char *stack = (const unsigned char *)thread_ctx[tid].stack;
+    size_t i = sizeof(unsigned long);
+    while (i < thread_ctx[tid].stack_size && stack[i] == STACK_PAINT) {
+        ++i;
+    }
+    return (int)(thread_ctx[tid].stack_size - i);
+
+}
+
+
+/* --------------------------------------------------------------- */
+/* stackless tasks                                                 */
+/* --------------------------------------------------------------- */
+
+static uthread_task_t *task_lookup(int id)
+{
+    int idx = id - MAX_THREAD_NUM;
+    if (idx < 0 || idx >= task_table_len) return NULL;
+    return task_table[idx];
+}
+
+static void task_make_ready(uthread_task_t *task)
+{
+    task->state = THREAD_READY;
+    task->next = NULL;
+    if (task_ready_tail != NULL) task_ready_tail->next = task;
+    else task_ready_head = task;
+    task_ready_tail = task;
+}
+
+int uthread_task_spawn(uthread_task_fn step, void *frame)
+{
+
+    if (step == NULL) {
+        fprintf(stderr, "thread library error: task step is NULL\n");
+        return -1;
+    }
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+
+    uthread_task_t *task = malloc(sizeof *task);
+    if (task == NULL) {
+        fprintf(stderr, "system error: task allocation failed\n");
+        exit(1);
+    }
+
+    int idx;
+    if (num_free_task_ids > 0) {
+        idx = free_task_ids[--num_free_task_ids];
+    } else {
+        if (task_table_len == task_table_cap) {
+            int cap = task_table_cap ? 2 * task_table_cap : 64;
+            uthread_task_t **table = realloc(task_table, cap * sizeof *table);
+            int *ids = realloc(free_task_ids, cap * sizeof *ids);
+            if (table == NULL || ids == NULL) {
+                fprintf(stderr, "system error: task allocation failed\n");
+                exit(1);
+            }
+            task_table = table;
+            free_task_ids = ids;
+            task_table_cap = cap;
+        }
+        idx = task_table_len++;
+    }
+
+    task->id = MAX_THREAD_NUM + idx;
+    task->sleep_until = 0;
+    task->resume_point = 0;
+    task->step = step;
+    task->frame = frame;
+    task->next = NULL;
+    task_table[idx] = task;
+
+    task_make_ready(task);
+
+    unmask_sigvtalrm(&old);
+    return task->id;
+}
+
+int uthread_task_sleep(uthread_task_t *task, int num_quantums)
+{
+    if (task == NULL || task->state != THREAD_RUNNING || num_quantums <= 0) {
+        fprintf(stderr, "thread library error: invalid sleep request\n");
+        return -1;
+    }
+
+    task->state = THREAD_BLOCKED;
+    task->sleep_until = total_quantums + num_quantums;
+
+    /* keep task_sleepers sorted by wake-up quantum (FIFO among equals) */
+    uthread_task_t **link = &task_sleepers;
+    while (*link != NULL && (*link)->sleep_until <= task->sleep_until) {
+        link = &(*link)->next;
+    }
+    task->next = *link;
+    *link = task;
+    return 0;
+}
+
+int uthread_task_block(uthread_task_t *task)
+{
+    if (task == NULL || task->state != THREAD_RUNNING) {
+        fprintf(stderr, "thread library error: invalid block request\n");
+        return -1;
+    }
+    task->state = THREAD_BLOCKED;
+    return 0;
+}
+
+/* uthread_resume for task IDs; SIGVTALRM is masked by the caller. */
+static int task_resume(int id)
+{
+    uthread_task_t *task = task_lookup(id);
+    if (task == NULL) {
+        fprintf(stderr, "thread library error: invalid tid\n");
+        return -1;
+    }
+    if (task->state != THREAD_BLOCKED || task->sleep_until != 0) {
+        return 0;
+    }
+    task_make_ready(task);
+    return 0;
+}
+
+/* Move every task whose sleep has expired to the READY queue. */
+static void wake_tasks(void)
+{
+    while (task_sleepers != NULL &&
+           task_sleepers->sleep_until <= (int)total_quantums) {
+        uthread_task_t *task = task_sleepers;
+        task_sleepers = task->next;
+        task->sleep_until = 0;
+        task_make_ready(task);
+    }
+}
+
+/* Run one step of a task just taken off the READY list. */
+static void run_task(uthread_task_t *task)
+{
+    int id = task->id;
+
+    task->state = THREAD_RUNNING;
+    uthread_task_status_t status = task->step(task);
+
+    if (status == UTHREAD_TASK_DONE) {
+        task_table[id - MAX_THREAD_NUM] = NULL;
+        free_task_ids[num_free_task_ids++] = id - MAX_THREAD_NUM;
+        free(task);
+        return;
+    }
+    if (task->state != THREAD_RUNNING) {
+        return;   /* parked (or already resumed) during the step */
+    }
+    if (status == UTHREAD_TASK_YIELD) {
+        task_make_ready(task);
+    } else {
+        task->state = THREAD_BLOCKED;
+    }
+}
+
+/* Run one step of each task on a detached ready list (on sched_stack). */
+static void run_task_list(void *head)
+{
+    uthread_task_t *task = head;
+    while (task != NULL) {
+        uthread_task_t *next = task->next;
+        run_task(task);
+        task = next;
+    }
+}
+
+/* Run one step of each task READY at this scheduling point. Tasks readied
+ * meanwhile, yielding ones included, wait for the next point, so a task
+ * that keeps yielding cannot hold the scheduler in its pick loop. Steps
+ * run on the scheduler stack: the thread being switched out may have
+ * little of its own left, being inside the SIGVTALRM handler.          */
+static void run_ready_tasks(void)
+{
+    uthread_task_t *task = task_ready_head;
+    if (task == NULL) return;
+
+    task_ready_head = task_ready_tail = NULL;
+    sched_call(run_task_list, task);
+    switch_start_ns = 0;   /* task steps are not switch cost */
+}
+
+
+/* --------------------------------------------------------------- */
+/* blocking-call offload                                           */
+/* --------------------------------------------------------------- */
+
+static void *offload_worker(void *unused)
+{
+    (void)unused;
+
+    /* signals belong to the uthread scheduler's kernel thread */
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    for (;;) {
+        pthread_mutex_lock(&offload_lock);
+        while (offload_head == NULL) {
+            pthread_cond_wait(&offload_cond, &offload_lock);
+        }
+        offload_job_t *job = offload_head;
+        offload_head = job->next;
+        if (offload_head == NULL) offload_tail = NULL;
+        pthread_mutex_unlock(&offload_lock);
+
+        job->result = job->fn(job->arg);
+
+        offload_job_t *top = atomic_load_explicit(&offload_done, memory_order_relaxed);
+        do {
+            job->next = top;
+        } while (!atomic_compare_exchange_weak_explicit(&offload_done, &top, job,
+                                                        memory_order_release,
+                                                        memory_order_relaxed));
+        sem_post(&idle_sem);
+    }
+    return NULL;
+}
+
+static void start_offload_pool(void)
+{
+    for (int i = 0; i < OFFLOAD_THREADS; ++i) {
+        pthread_t helper;
+        if (pthread_create(&helper, NULL, offload_worker, NULL) != 0) {
+            fprintf(stderr, "system error: pthread_create failed\n");
+            exit(1);
+        }
+        pthread_detach(helper);
+    }
+    offload_started = 1;
+}
+
+/* Resume the threads whose offloaded calls have finished, oldest first.
+ * Jobs of threads terminated meanwhile are simply freed.              */
+static void drain_offload_completions(void)
+{
+    offload_job_t *job = atomic_exchange_explicit(&offload_done, NULL, memory_order_acquire);
+
+    offload_job_t *fifo = NULL;
+    while (job != NULL) {
+        offload_job_t *next = job->next;
+        job->next = fifo;
+        fifo = job;
+        job = next;
+    }
+
+    for (job = fifo; job != NULL; ) {
+        offload_job_t *next = job->next;
+        int tid = job->tid;
+        if (thread_ctx[tid].offload_job == job) {
+            thread_ctx[tid].wait = THREAD_WAIT_NONE;
+            if (threads[tid].state == THREAD_BLOCKED) {
+                make_ready(tid);
+            }
+        } else {
+            free(job);
+        }
+        job = next;
+    }
+}
+
+int uthread_offload(uthread_offload_fn fn, void *arg, void **result)
+{
+
+    if (fn == NULL) {
+        fprintf(stderr, "thread library error: offload function is NULL\n");
+        return -1;
+    }
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+
+    if (!offload_started) start_offload_pool();
+
+    offload_job_t *job = malloc(sizeof *job);
+    if (job == NULL) {
+        fprintf(stderr, "system error: offload allocation failed\n");
+        exit(1);
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->result = NULL;
+    job->tid = current_tid;
+    job->next = NULL;
+
+    thread_ctx[current_tid].wait = THREAD_WAIT_OFFLOAD;
+    thread_ctx[current_tid].offload_job = job;
+
+    pthread_mutex_lock(&offload_lock);
+    if (offload_tail != NULL) offload_tail->next = job;
+    else offload_head = job;
+    offload_tail = job;
+    pthread_cond_signal(&offload_cond);
+    pthread_mutex_unlock(&offload_lock);
+
+    threads[current_tid].state = THREAD_BLOCKED;
+    schedule_next();   /* back here once drain_offload_completions readied us */
+
+    thread_ctx[current_tid].offload_job = NULL;
+    if (result != NULL) *result = job->result;
+    free(job);
+
+    unmask_sigvtalrm(&old);
+    return 0;
+}
+
+
+/* --------------------------------------------------------------- */
+/* EDF real-time class                                             */
+/* --------------------------------------------------------------- */
+
+/* Charge the quantum that just ended to prev, a periodic thread. */
+static void rt_charge(int prev)
+{
+    if (rt[prev].period > 0 && !rt[prev].job_done && rt[prev].budget_left > 0 &&
+        --rt[prev].budget_left == 0) {
+        ++rt[prev].overruns;   /* budget used up before the job finished */
+    }
+}
+
+/* Start the jobs whose release time has come. Called once per quantum,
+ * SIGVTALRM masked.                                                    */
+static void rt_release(void)
+{
+    for (int k = 0; k < num_rt; ++k) {
+        int tid = rt_tids[k];
+        while (rt[tid].next_release <= total_quantums) {
+            if (!rt[tid].job_done && rt[tid].budget_left > 0) {
+                ++rt[tid].overruns;   /* deadline reached first */
+            }
+            rt[tid].deadline = rt[tid].next_release + rt[tid].period;
+            rt[tid].next_release += rt[tid].period;
+            rt[tid].budget_left = rt[tid].budget;
+            rt[tid].job_done = 0;
+
+            if (thread_ctx[tid].wait == THREAD_WAIT_PERIOD) {
+                thread_ctx[tid].wait = THREAD_WAIT_NONE;
+                make_ready(tid);
+            }
+        }
+    }
+}
+
+/* Earliest-deadline READY periodic thread with budget left, taken off the
+ * READY queue; -1 if there is none.                                      */
+static int pick_edf(void)
+{
+    int best = -1;
+    for (int k = 0; k < num_rt; ++k) {
+        int tid = rt_tids[k];
+        if (threads[tid].state == THREAD_READY && rt[tid].budget_left > 0 &&
+            !rt[tid].job_done &&
+            (best == -1 || rt[tid].deadline < rt[best].deadline)) {
+            best = tid;
+        }
     }
+    if (best != -1) queue_delete(&ready_q, best);
+    return best;
+}
+
+
+/* --------------------------------------------------------------- */
+/* CPU-quota thread groups                                         */
+/* --------------------------------------------------------------- */
+
+int uthread_group_create(int parent, int quota, int period){
+
+    if (period <= 0 || quota <= 0 || quota > period) {
+        fprintf(stderr, "thread library error: invalid quota or period\n");
+        return -1;
+    }
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+
+    if (parent != -1 &&
+        (parent < 0 || parent >= MAX_GROUP_NUM || !groups[parent].used)) {
+        fprintf(stderr, "thread library error: invalid group\n");
+        unmask_sigvtalrm(&old);
+        return -1;
+    }
+    if (num_groups >= MAX_GROUP_NUM) {
+        fprintf(stderr, "thread library error: too many groups\n");
+        unmask_sigvtalrm(&old);
+        return -1;
+    }
+
+    int gid = num_groups++;
+    groups[gid].used = 1;
+    groups[gid].parent = parent;
+    groups[gid].quota = quota;
+    groups[gid].period = period;
+    groups[gid].usage = 0;
+    groups[gid].period_start = total_quantums;
+
+    unmask_sigvtalrm(&old);
+    return gid;
+}
+
+int uthread_group_add(int gid, int tid){
+
+    if (tid < 0 || tid >= MAX_THREAD_NUM ||
+        threads[tid].state == THREAD_UNUSED ||
+        threads[tid].state == THREAD_TERMINATED) {
+        fprintf(stderr, "thread library error: invalid tid\n");
+        return -1;
+    }
+    if (gid != -1 && (gid < 0 || gid >= MAX_GROUP_NUM || !groups[gid].used)) {
+        fprintf(stderr, "thread library error: invalid group\n");
+        return -1;
+    }
+
+    group_of[tid] = gid;
+    return 0;
+}
+
+/* Roll the group over to its current period. */
+static void group_refresh(int gid)
+{
+    group_t *g = &groups[gid];
+    if (total_quantums - g->period_start >= (unsigned long)g->period) {
+        g->period_start += (total_quantums - g->period_start) / g->period * g->period;
+        g->usage = 0;
+    }
+}
+
+/* Charge the quantum prev just ran to its group and all ancestors. */
+static void group_charge(int prev)
+{
+    for (int gid = group_of[prev]; gid != -1; gid = groups[gid].parent) {
+        group_refresh(gid);
+        ++groups[gid].usage;
+    }
+}
+
+static int thread_throttled(int tid)
+{
+    for (int gid = group_of[tid]; gid != -1; gid = groups[gid].parent) {
+        group_refresh(gid);
+        if (groups[gid].usage >= groups[gid].quota) return 1;
+    }
+    return 0;
+}
+
+
+/* --------------------------------------------------------------- */
+/* external wakeups and idling                                     */
+/* --------------------------------------------------------------- */
+
+/* Common part of uthread_resume / uthread_resume_async for a live thread:
+ * only explicitly blocked threads (not sleeping, not waiting on a library
+ * event) go back to READY. SIGVTALRM is masked by the caller.           */
+static void resume_thread(int tid)
+{
+    if (threads[tid].state == THREAD_BLOCKED && threads[tid].sleep_until == 0 &&
+        thread_ctx[tid].wait == THREAD_WAIT_NONE) {
+        make_ready(tid);
+    }
+}
+
+int uthread_resume_async(int tid)
+{
+    if (tid < 0 || tid >= MAX_THREAD_NUM) {
+        return -1;
+    }
+
+    atomic_fetch_or(&resume_inbox[tid / 64], 1UL << (tid % 64));
+    if (atomic_load(&scheduler_idle)) {
+        sem_post(&idle_sem);
+    }
+    return 0;
+}
+
+/* Apply the resumes posted through uthread_resume_async. */
+static void drain_resume_inbox(void)
+{
+    for (int w = 0; w < INBOX_WORDS; ++w) {
+        if (atomic_load_explicit(&resume_inbox[w], memory_order_relaxed) == 0) continue;
+
+        unsigned long bits = atomic_exchange(&resume_inbox[w], 0UL);
+        while (bits != 0) {
+            int tid = w * 64 + __builtin_ctzl(bits);
+            bits &= bits - 1;
+            if (threads[tid].state == THREAD_UNUSED ||
+                threads[tid].state == THREAD_TERMINATED) {
+                continue;
+            }
+            resume_thread(tid);
+            if (threads[tid].state != THREAD_READY) {
+                wake_permit[tid] = 1;   /* not parked yet: keep the wakeup */
+            }
+        }
+    }
+}
+
+/* Everything that other kernel threads or signal handlers hand over. */
+static void drain_events(void)
+{
+    if (offload_started) drain_offload_completions();
+    drain_resume_inbox();
+}
+
+static int events_pending(void)
+{
+    if (atomic_load(&offload_done) != NULL) return 1;
+    for (int w = 0; w < INBOX_WORDS; ++w) {
+        if (atomic_load(&resume_inbox[w]) != 0) return 1;
+    }
+    return 0;
+}
 
-    /*only resume blocked threads that have sleep_until = 0 
-    we cant resume a sleeping thread as it is still blocked*/
+/* Threads and tasks whose sleep is over, and periodic releases. */
+static void wake_due(void)
+{
+    for (int i = 0; i < MAX_THREAD_NUM; ++i) {
+        if (threads[i].state == THREAD_BLOCKED &&
+            threads[i].sleep_until > 0 &&
+            threads[i].sleep_until <= total_quantums) {
+            /* Sleep finished => READY*/                        
+            wake_due_q[i] = threads[i].sleep_until;
+            threads[i].sleep_until = 0;
+            make_ready(i);
+        }
+    }
+    wake_tasks();
+    if (num_rt > 0) rt_release();
+    if (watchdog_quantums > 0) watchdog_scan();
+}
 
-    if (threads[tid].state == THREAD_BLOCKED && threads[tid].sleep_until == 0) {
-        threads[tid].state = THREAD_READY;
-        queue_enqueue(&ready_q, tid);
+/* No thread can run. Sleep in the kernel until another kernel thread or a
+ * signal handler posts an event, or for one quantum; an idle quantum still
+ * counts, so sleepers and periodic releases come due.  SIGVTALRM is masked
+ * (and ITIMER_VIRTUAL does not advance while the process sleeps).         */
+static void idle_wait(void)
+{
+    if (atomic_load_explicit(&log_dirty, memory_order_relaxed)) log_flush_locked();
+
+    atomic_store(&scheduler_idle, 1);
+    switch_start_ns = 0;
+
+    int timed_out = 0;
+    if (!events_pending()) {
+        if (sim_mode) {
+            timed_out = 1;
+        } else {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec  += quantum_usec / SECOND;
+            until.tv_nsec += (long)(quantum_usec % SECOND) * 1000;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec += 1;
+                until.tv_nsec -= 1000000000L;
+            }
+            if (sem_timedwait(&idle_sem, &until) == -1) {
+                if (errno != ETIMEDOUT && errno != EINTR) {
+                    fprintf(stderr, "system error: sem_timedwait failed\n");
+                    exit(1);
+                }
+                timed_out = (errno == ETIMEDOUT);
+            }
+        }
     }
 
-    unmask_sigvtalrm(&old);
-    return 0;
+    atomic_store(&scheduler_idle, 0);
 
+    if (timed_out) {
+        ++total_quantums;
+        if (sim_mode) sim_steps_left = sim_next_budget();
+        wake_due();
+    }
+    drain_events();
 }
 
 
-int uthread_sleep(int num_quantums){
+/* --------------------------------------------------------------- */
+/* buffered logging                                                */
+/* --------------------------------------------------------------- */
+
+/* Write out every ring with one writev; SIGVTALRM is masked by the caller.
+ * This runs on the stack of the thread being switched out, so the iovecs
+ * (about 4 KiB) are static rather than local.                              */
+static struct iovec log_iov[2 * MAX_THREAD_NUM];
+static int log_owner[2 * MAX_THREAD_NUM];
+
+static void log_flush_locked(void)
+{
+    struct iovec *iov = log_iov;
+    int *owner = log_owner;
+    int cnt = 0;
+
+    atomic_store(&log_dirty, 0);
+    for (int i = 0; i < MAX_THREAD_NUM; ++i) {
+        log_ring_t *ring = &log_rings[i];
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head == tail) continue;
+
+        size_t start = head & (LOG_BUF_SIZE - 1);
+        size_t len = tail - head;
+        size_t first = (start + len > LOG_BUF_SIZE) ? LOG_BUF_SIZE - start : len;
+        iov[cnt].iov_base = ring->data + start;
+        iov[cnt].iov_len = first;
+        owner[cnt++] = i;
+        if (first < len) {
+            iov[cnt].iov_base = ring->data;
+            iov[cnt].iov_len = len - first;
+            owner[cnt++] = i;
+        }
+    }
+
+    int k = 0;
+    while (k < cnt) {
+        ssize_t n = writev(STDOUT_FILENO, iov + k, cnt - k);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;   /* nowhere to log to: drop what is buffered */
+        }
+        /* consume n bytes, possibly ending inside an iovec */
+        while (k < cnt && (size_t)n >= iov[k].iov_len) {
+            n -= iov[k].iov_len;
+            atomic_fetch_add_explicit(&log_rings[owner[k]].head, iov[k].iov_len,
+                                      memory_order_release);
+            ++k;
+        }
+        if (k < cnt && n > 0) {
+            iov[k].iov_base = (char *)iov[k].iov_base + n;
+            iov[k].iov_len -= n;
+            atomic_fetch_add_explicit(&log_rings[owner[k]].head, (size_t)n,
+                                      memory_order_release);
+        }
+    }
+    for (; k < cnt; ++k) {
+        atomic_fetch_add_explicit(&log_rings[owner[k]].head, iov[k].iov_len,
+                                  memory_order_release);
+    }
+}
 
+void uthread_log_flush(void)
+{
     sigset_t old;
     mask_sigvtalrm(&old);
+    log_flush_locked();
+    unmask_sigvtalrm(&old);
+}
+
+/* Append one formatted line (len as returned by vsnprintf) to the ring of
+ * the running thread.                                                    */
+static int log_append(const char *line, int len)
+{
+    if (len < 0) return -1;
+    if (len >= LOG_LINE_MAX) len = LOG_LINE_MAX - 1;
 
+    log_ring_t *ring = &log_rings[current_tid];
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail + len - atomic_load_explicit(&ring->head, memory_order_acquire) > LOG_BUF_SIZE) {
+        uthread_log_flush();   /* ring full: make room synchronously */
+    }
 
-    /* main thread cannot sleep and num_quantums must be positive */
-    if (current_tid == 0 || num_quantums <= 0) {
-        fprintf(stderr, "thread library error: invalid sleep request\n");
+    size_t start = tail & (LOG_BUF_SIZE - 1);
+    size_t first = (start + len > LOG_BUF_SIZE) ? LOG_BUF_SIZE - start : (size_t)len;
+    memcpy(ring->data + start, line, first);
+    memcpy(ring->data, line + first, len - first);
+
+    atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+    atomic_store_explicit(&log_dirty, 1, memory_order_relaxed);
+    return len;
+}
+
+/* Threads on a STACK_SIZE stack format on the scheduler stack instead:
+ * vsnprintf alone takes most of their stack. SIGVTALRM is masked around
+ * it, so a single static line will do.                                  */
+typedef struct {
+    const char *fmt;
+    va_list *ap;
+    int len;
+} log_args_t;
+
+static char log_line[LOG_LINE_MAX];
+
+static void log_format(void *arg)
+{
+    log_args_t *args = arg;
+    args->len = vsnprintf(log_line, sizeof log_line, args->fmt, *args->ap);
+}
+
+/* Format in place, without a syscall; for threads with room to spare. */
+static __attribute__((noinline)) int log_format_local(const char *fmt, va_list *ap)
+{
+    char line[LOG_LINE_MAX];
+    return log_append(line, vsnprintf(line, sizeof line, fmt, *ap));
+}
+
+int uthread_log(const char *fmt, ...)
+{
+    int len;
+    va_list ap;
+    va_start(ap, fmt);
+    if (thread_ctx[current_tid].stack == thread_stacks[current_tid]) {
+        sigset_t old;
+        mask_sigvtalrm(&old);
+        log_args_t args = { fmt, &ap, -1 };
+        sched_call(log_format, &args);
+        len = log_append(log_line, args.len);
         unmask_sigvtalrm(&old);
+    } else {
+        len = log_format_local(fmt, &ap);
+    }
+    va_end(ap);
+    return len;
+}
+
+
+/* --------------------------------------------------------------- */
+/* shared-memory metrics                                           */
+/* --------------------------------------------------------------- */
+
+/* Charge the running thread up to now; called when it stops running, so
+ * scheduler work, idle waits and task steps are charged to no thread.  */
+static void metrics_charge(int tid)
+{
+    if (run_start_ns == 0) return;
+    run_ns[tid] += now_ns() - run_start_ns;
+    run_start_ns = 0;
+}
+
+/* Start charging next (current_tid) and republish the snapshot under the
+ * sequence lock. Called on every switch with SIGVTALRM masked; plain
+ * stores and vDSO clock reads, no syscalls.                             */
+static void metrics_publish(int prev)
+{
+    uthread_metrics_t *m = metrics;
+    metrics_charge(prev);   /* direct handoffs skip schedule_next's charge */
+    unsigned long now = now_ns();
+    run_start_ns = now;
+    ++num_switches;
+
+    uint32_t seq = m->seq;
+    __atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    m->current_tid = current_tid;
+    m->quantum_usecs = quantum_usec;
+    m->total_quantums = total_quantums;
+    m->switches = num_switches;
+    m->updated_ns = now;
+    for (int i = 0; i < MAX_THREAD_NUM; ++i) {
+        m->threads[i].state = threads[i].state;
+        m->threads[i].quantums = threads[i].quantums;
+        m->threads[i].sleep_until = threads[i].sleep_until;
+        m->threads[i].run_ns = run_ns[i];
+    }
+
+    __atomic_store_n(&m->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void metrics_unlink(void)
+{
+    shm_unlink(metrics_name);
+}
+
+int uthread_metrics_export(const char *name)
+{
+    char default_name[32];
+    if (name == NULL) {
+        snprintf(default_name, sizeof default_name, "/uthread.%d", (int)getpid());
+        name = default_name;
+    }
+    if (name[0] != '/' || strchr(name + 1, '/') != NULL ||
+        strlen(name) >= sizeof metrics_name) {
+        fprintf(stderr, "thread library error: invalid metrics segment name\n");
+        return -1;
+    }
+    if (metrics != NULL) {
+        fprintf(stderr, "thread library error: metrics already exported\n");
         return -1;
     }
-   
 
-    //make it sleep until total quantums reaches a certain number
-    threads[current_tid].sleep_until = total_quantums + num_quantums;
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "system error: shm_open failed\n");
+        exit(1);
+    }
+    if (ftruncate(fd, sizeof(uthread_metrics_t)) == -1) {
+        fprintf(stderr, "system error: ftruncate failed\n");
+        exit(1);
+    }
+    void *p = mmap(NULL, sizeof(uthread_metrics_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "system error: mmap failed\n");
+        exit(1);
+    }
+    close(fd);
 
-    threads[current_tid].state = THREAD_BLOCKED;
-    // /* context-switch to the next READY thread
-    // The call never returns until this thread is awakened by timer_handler()*/
-   
+    strcpy(metrics_name, name);
+    atexit(metrics_unlink);
+
+    uthread_metrics_t *m = p;
+    m->magic = UTHREAD_METRICS_MAGIC;
+    m->version = UTHREAD_METRICS_VERSION;
+    m->pid = (int32_t)getpid();
+    m->max_threads = MAX_THREAD_NUM;
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+    metrics = m;
+    run_start_ns = 0;
+    metrics_publish(current_tid);
     unmask_sigvtalrm(&old);
-    schedule_next();                    /* keeps SIGVTALRM blocked */
-   
-    // //resume here only after sleep expires
-    
     return 0;
-    
 }
 
 
+/* --------------------------------------------------------------- */
+/* sampling profiler                                               */
+/* --------------------------------------------------------------- */
 
+/* SIGPROF (ITIMER_PROF, independent of the scheduler's ITIMER_VIRTUAL) takes
+ * a frame-pointer backtrace of whatever uthread is running. Each sample gets
+ * its slot by one atomic increment, so the handler never locks and never
+ * allocates; uthread_profiler_stop aggregates after the timer is off.   */
+#define PROF_MAX_SAMPLES 16384
+#define PROF_MAX_DEPTH   32
+
+typedef struct {
+    int tid;
+    int depth;
+    void *pc[PROF_MAX_DEPTH];   /* pc[0] is the leaf */
+} prof_sample_t;
+
+static prof_sample_t *prof_samples = NULL;
+static atomic_size_t prof_next = 0;
+static atomic_int prof_running = 0;
+static pthread_t prof_thread;           /* kernel thread running the uthreads */
+static char *main_stack_lo, *main_stack_hi;
+
+/* The handler runs on its own alternate stack: the interrupted uthread's
+ * stack may be a nearly full STACK_SIZE one, too small for the kernel's
+ * signal frame. It never switches context, and SIGVTALRM is blocked while
+ * it runs, so the scheduler cannot switch away from the alternate stack. */
+static char *prof_altstack = NULL;
+
+static void prof_handler(int sig, siginfo_t *info, void *uc_void)
+{
+    (void)sig; (void)info;
+    if (!atomic_load_explicit(&prof_running, memory_order_relaxed) ||
+        !pthread_equal(pthread_self(), prof_thread)) {
+        return;
+    }
+    size_t slot = atomic_fetch_add_explicit(&prof_next, 1, memory_order_relaxed);
+    if (slot >= PROF_MAX_SAMPLES) return;
+
+    const ucontext_t *uc = uc_void;
+    const greg_t *regs = uc->uc_mcontext.gregs;
+    /* Both timers expired on the same tick and SIGPROF landed on the entry of
+     * timer_handler: sample the context SIGVTALRM preempted instead, which
+     * the kernel saved just above the handler's return address.            */
+    if (regs[REG_RIP] == (greg_t)timer_handler) {
+        const ucontext_t *inner = (const ucontext_t *)(regs[REG_RSP] + sizeof(void *));
+        regs = inner->uc_mcontext.gregs;
+    }
 
-int uthread_get_tid(){
+    int tid = current_tid;
+    prof_sample_t *sample = &prof_samples[slot];
+    sample->tid = tid;
+    sample->pc[0] = (void *)regs[REG_RIP];
+    int depth = 1;
+
+    /* walk saved rbp links, only while they stay inside the thread's stack */
+    char *lo = thread_ctx[tid].stack, *hi = lo + thread_ctx[tid].stack_size;
+    if (lo == NULL) {
+        lo = main_stack_lo;
+        hi = main_stack_hi;
+    }
+    char *fp = (char *)regs[REG_RBP];
+    while (depth < PROF_MAX_DEPTH && fp >= lo && fp + 2 * sizeof(void *) <= hi &&
+           ((unsigned long)fp & (sizeof(void *) - 1)) == 0) {
+        void *ret = ((void **)fp)[1];
+        if (ret == NULL) break;
+        sample->pc[depth++] = ret;
+        char *up = ((char **)fp)[0];
+        if (up <= fp) break;     /* frames only grow toward the stack base */
+        fp = up;
+    }
+    sample->depth = depth;
+}
 
-    return current_tid;
+static int prof_set_timer(int hz)
+{
+    struct itimerval timer = {0};
+    if (hz > 0) {
+        timer.it_value.tv_usec = SECOND / hz;
+        timer.it_interval = timer.it_value;
+    }
+    return setitimer(ITIMER_PROF, &timer, NULL);
 }
 
+int uthread_profiler_start(int hz)
+{
+    if (hz <= 0 || hz > SECOND) {
+        fprintf(stderr, "thread library error: invalid sampling rate\n");
+        return -1;
+    }
+    if (atomic_load(&prof_running)) {
+        fprintf(stderr, "thread library error: profiler already running\n");
+        return -1;
+    }
 
+    if (prof_samples == NULL) {
+        prof_samples = malloc(PROF_MAX_SAMPLES * sizeof(prof_sample_t));
+        if (prof_samples == NULL) {
+            fprintf(stderr, "system error: malloc failed\n");
+            exit(1);
+        }
+    }
 
-int uthread_get_total_quantums(){
+    /* bounds of the main thread's stack, for thread 0's backtraces */
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0 ||
+        pthread_attr_getstack(&attr, &addr, &size) != 0) {
+        fprintf(stderr, "system error: pthread_getattr_np failed\n");
+        exit(1);
+    }
+    pthread_attr_destroy(&attr);
+    main_stack_lo = addr;
+    main_stack_hi = (char *)addr + size;
+
+    if (prof_altstack == NULL) {
+        size_t frame = getauxval(AT_MINSIGSTKSZ);
+        if (frame < (size_t)SIGSTKSZ) frame = SIGSTKSZ;
+        stack_t ss = {0};
+        ss.ss_size = frame + STACK_SIZE;
+        ss.ss_sp = prof_altstack = malloc(ss.ss_size);
+        if (prof_altstack == NULL) {
+            fprintf(stderr, "system error: malloc failed\n");
+            exit(1);
+        }
+        if (sigaltstack(&ss, NULL) == -1) {
+            fprintf(stderr, "system error: sigaltstack failed\n");
+            exit(1);
+        }
+    }
 
-    return total_quantums;
+    prof_thread = pthread_self();
+    atomic_store(&prof_next, 0);
+
+    struct sigaction sa = {0};
+    sa.sa_sigaction = prof_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGVTALRM);
+    sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    if (sigaction(SIGPROF, &sa, NULL) == -1) {
+        fprintf(stderr, "system error: sigaction failed\n");
+        exit(1);
+    }
 
+    atomic_store(&prof_running, 1);
+    if (prof_set_timer(hz) == -1) {
+        fprintf(stderr, "system error: setitimer failed\n");
+        exit(1);
+    }
+    return 0;
 }
 
+static int prof_sample_cmp(const void *a, const void *b)
+{
+    const prof_sample_t *x = a, *y = b;
+    if (x->tid != y->tid) return x->tid < y->tid ? -1 : 1;
+    if (x->depth != y->depth) return x->depth < y->depth ? -1 : 1;
+    return memcmp(x->pc, y->pc, x->depth * sizeof(void *));
+}
 
-int uthread_get_quantums(int tid){
+static void prof_print_frame(FILE *out, void *pc, int is_leaf)
+{
+    /* a return address points past the call; look up the call itself */
+    void *lookup = is_leaf ? pc : (char *)pc - 1;
+    Dl_info info;
+    if (dladdr(lookup, &info) && info.dli_sname != NULL) {
+        fputs(info.dli_sname, out);
+    } else if (info.dli_fname != NULL && info.dli_fbase != NULL) {
+        const char *base = strrchr(info.dli_fname, '/');
+        fprintf(out, "%s+0x%lx", base ? base + 1 : info.dli_fname,
+                (unsigned long)((char *)lookup - (char *)info.dli_fbase));
+    } else {
+        fprintf(out, "%p", pc);
+    }
+}
 
-    if (tid < 0 || tid >= MAX_THREAD_NUM ||
-    threads[tid].state == THREAD_UNUSED ||
-    threads[tid].state == THREAD_TERMINATED) {
-    fprintf(stderr, "thread library error: invalid tid\n");
-    return -1;
+int uthread_profiler_stop(const char *path)
+{
+    if (!atomic_load(&prof_running)) {
+        fprintf(stderr, "thread library error: profiler not running\n");
+        return -1;
     }
-    return threads[tid].quantums;
+    if (prof_set_timer(0) == -1) {
+        fprintf(stderr, "system error: setitimer failed\n");
+        exit(1);
+    }
+    atomic_store(&prof_running, 0);
+
+    FILE *out = (path == NULL) ? stdout : fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "thread library error: cannot open profile output\n");
+        return -1;
+    }
+
+    size_t n = atomic_load(&prof_next);
+    if (n > PROF_MAX_SAMPLES) {
+        fprintf(stderr, "thread library error: profiler dropped %zu samples\n",
+                n - PROF_MAX_SAMPLES);
+        n = PROF_MAX_SAMPLES;
+    }
+
+    /* identical stacks become adjacent; print each run once, root first */
+    qsort(prof_samples, n, sizeof(prof_sample_t), prof_sample_cmp);
+    for (size_t i = 0; i < n; ) {
+        size_t j = i + 1;
+        while (j < n && prof_sample_cmp(&prof_samples[i], &prof_samples[j]) == 0) ++j;
+
+        const prof_sample_t *sample = &prof_samples[i];
+        fprintf(out, "uthread_%d", sample->tid);
+        for (int d = sample->depth - 1; d >= 0; --d) {
+            fputc(';', out);
+            prof_print_frame(out, sample->pc[d], d == 0);
+        }
+        fprintf(out, " %zu\n", j - i);
+        i = j;
+    }
+
+    if (out != stdout) fclose(out);
+    else fflush(out);
+    return (int)n;
+}
+
+
+/* --------------------------------------------------------------- */
+/* latency histograms and watchdog                                 */
+/* --------------------------------------------------------------- */
+
+static int copy_hist(const uthread_hist_t *table, int tid, uthread_hist_t *out)
+{
+    if (out == NULL || tid < -1 || tid >= MAX_THREAD_NUM ||
+        (tid >= 0 && (threads[tid].state == THREAD_UNUSED ||
+                      threads[tid].state == THREAD_TERMINATED))) {
+        fprintf(stderr, "thread library error: invalid tid\n");
+        return -1;
+    }
+
+    sigset_t old;
+    mask_sigvtalrm(&old);
+    *out = table[tid == -1 ? MAX_THREAD_NUM : tid];
+    unmask_sigvtalrm(&old);
+    return 0;
+}
+
+int uthread_get_latency_hist(int tid, uthread_hist_t *out)
+{
+    return copy_hist(latency_hist, tid, out);
+}
+
+int uthread_get_lateness_hist(int tid, uthread_hist_t *out)
+{
+    return copy_hist(lateness_hist, tid, out);
+}
 
+unsigned long uthread_hist_percentile(const uthread_hist_t *hist, double percentile)
+{
+    if (hist == NULL || hist->count == 0) return 0;
+
+    unsigned long rank = (unsigned long)(percentile / 100.0 * hist->count + 0.5);
+    if (rank == 0) rank = 1;
+    unsigned long seen = 0;
+    for (int b = 0; b < UTHREAD_HIST_BUCKETS; ++b) {
+        seen += hist->buckets[b];
+        if (seen >= rank) {
+            unsigned long top = hist_bucket_max(b);
+            return top < hist->max ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+int uthread_set_watchdog(int max_wait_quantums)
+{
+    if (max_wait_quantums < 0) {
+        fprintf(stderr, "thread library error: invalid watchdog threshold\n");
+        return -1;
+    }
+    watchdog_quantums = max_wait_quantums;
+    return 0;
 }
 
 
@@ -488,64 +2614,70 @@ void schedule_next(void){
     sigset_t old;
     mask_sigvtalrm(&old);
     int prev = current_tid;
+    if (adaptive) switch_start_ns = now_ns();
+    if (metrics != NULL) metrics_charge(prev);
+
+    check_stack_canary(prev);
 
 
     /* Update quantum counters*/                       
     ++total_quantums;
+    if (sim_mode) sim_steps_left = sim_next_budget();
 
     if (current_tid >= 0 && threads[current_tid].state != THREAD_TERMINATED) {
         ++threads[current_tid].quantums;
     }
 
+    if (num_rt > 0) rt_charge(prev);
+    if (num_groups > 0) group_charge(prev);
 
+    wake_due();
+    drain_events();
 
-    //handle sleeping threads
-    for (int i = 0; i < MAX_THREAD_NUM; ++i) {
-        if (threads[i].state == THREAD_BLOCKED &&
-            threads[i].sleep_until > 0 &&
-            threads[i].sleep_until <= total_quantums) {
-            /* Sleep finished => READY*/                        
-            threads[i].sleep_until = 0;
-            threads[i].state = THREAD_READY;
-            queue_enqueue(&ready_q, i);
-        }
-    }
-
+    if (atomic_load_explicit(&log_dirty, memory_order_relaxed)) log_flush_locked();
     
 
 
     if (threads[prev].state == THREAD_RUNNING && 
         threads[prev].state != THREAD_TERMINATED)
     {
-        threads[prev].state = THREAD_READY;
-        queue_enqueue(&ready_q, prev);
-    }
-
-
-    if (queue_is_empty(&ready_q)) {
-        //no other READY threads just keep running prev
-        unmask_sigvtalrm(&old);
-        return;
+        make_ready(prev);
     }
 
 
+    /* Ready tasks run inline first, one step each; then pick the next READY
+     * thread: periodic threads by EDF first, then round robin */
+    run_ready_tasks();
+    int next = pick_edf();
+    int skips_left = (int)ready_q.size;   /* throttled threads passed over */
+    while (next < 0) {
+        if (skips_left == 0) {
+            //nothing READY, or all of it throttled (prev included): wait
+            //for a wakeup or an idle quantum, which may end a group period
+            idle_wait();
+            run_ready_tasks();
+            next = pick_edf();
+            skips_left = (int)ready_q.size;
+            continue;
+        }
 
-
-    /* Pick next READY thread  */                           
-    int next;
-    queue_dequeue(&ready_q, &next);
-    threads[next].state = THREAD_RUNNING;
-
-    current_tid = next;
+        queue_dequeue(&ready_q, &next);
+        if (num_groups > 0 && thread_throttled(next)) {
+            queue_enqueue(&ready_q, next);
+            --skips_left;
+            next = -1;
+        }
+    }
+    note_dispatch(next);
+    if (adaptive) adapt_quantum();
 
     /* Context-switch
     SIGVTALRM is blocked for the switch
     new thread resumes with same mask and timer re-enabled */ 
-
-
-    
-    context_switch(&threads[prev], &threads[next]);
+    dispatch(prev, next);
     //get here only when the prev thread is rescheduled 
+    if (switch_start_ns != 0) sample_switch_cost();
+
     unmask_sigvtalrm(&old);  //TODO: check order of this
     
    
@@ -558,7 +2690,77 @@ void schedule_next(void){
 }
 
 
-void context_switch(thread_t *current, thread_t *next){
+/* Run next (already taken off the READY queue) in place of prev; returns
+ * when prev is scheduled again. SIGVTALRM is masked by the caller.      */
+static void dispatch(int prev, int next)
+{
+    threads[next].state = THREAD_RUNNING;
+    current_tid = next;
+    if (metrics != NULL) metrics_publish(prev);
+
+    if (thread_ctx[prev].flags & UTHREAD_FPU) fpu_ctl_save(&thread_ctx[prev]);
+
+    switch_threads(prev, next);
+
+    if (thread_ctx[prev].flags & UTHREAD_FPU) fpu_ctl_restore(&thread_ctx[prev]);
+}
+
+/* Copy the live part of the shared stack owner's frames out to its buffer. */
+static void save_shared_stack(int tid)
+{
+    thread_ctx_t *ctx = &thread_ctx[tid];
+    char *sp = (char *)untranslate_address(ctx->env->__jmpbuf[JB_SP]);
+    size_t len = (size_t)(shared_stack + SHARED_STACK_SIZE - sp);
+
+    if (len > ctx->saved_cap) {
+        char *buf = realloc(ctx->saved_stack, len);
+        if (buf == NULL) {
+            fprintf(stderr, "system error: stack allocation failed\n");
+            exit(1);
+        }
+        ctx->saved_stack = buf;
+        ctx->saved_cap = len;
+    }
+    memcpy(ctx->saved_stack, sp, len);
+    ctx->saved_len = len;
+    if (len > ctx->saved_peak) ctx->saved_peak = len;
+}
+
+/* Entered fresh on switch_stack each time a shared-stack thread that does not
+ * own the run stack is switched in: swap the stack contents, then jump.     */
+static void restore_shared_stack(void)
+{
+    int next = restore_tid;
+    thread_ctx_t *ctx = &thread_ctx[next];
+
+    if (shared_owner >= 0 &&
+        threads[shared_owner].state != THREAD_UNUSED &&
+        threads[shared_owner].state != THREAD_TERMINATED) {
+        save_shared_stack(shared_owner);
+    }
+    memcpy(shared_stack + SHARED_STACK_SIZE - ctx->saved_len, ctx->saved_stack, ctx->saved_len);
+    shared_owner = next;
+
+    siglongjmp(ctx->env, 1);
+}
+
+/* context_switch from prev to next, refilling the shared run stack first if
+ * next runs on it and does not own it.                                     */
+static void switch_threads(int prev, int next)
+{
+    if (!(thread_ctx[next].flags & UTHREAD_SHARED_STACK) || shared_owner == next) {
+        context_switch(&thread_ctx[prev], &thread_ctx[next]);
+        return;
+    }
+
+    if (sigsetjmp(thread_ctx[prev].env, 1) != 0) {
+        return;   /* prev resumed (its stack was restored first if shared) */
+    }
+    restore_tid = next;
+    siglongjmp(restore_ctx, 1);
+}
+
+void context_switch(thread_ctx_t *current, thread_ctx_t *next){
 
     /* Save current state; sigsetjmp() returns 0 the first time   */
     int retval = sigsetjmp(current->env, 1);
@@ -580,31 +2782,41 @@ void timer_handler(int signum){
 }
 
 
+void uthread_tick(void){
+
+    if (!sim_mode) return;
+
+    //quantum budget used up => preempt, exactly where timer_handler would
+    if (--sim_steps_left <= 0) {
+        schedule_next();
+    }
+}
+
+
 
 
 
 void setup_thread(int tid, char *stack, thread_entry_point entry_point){
-    //Save a clean context     
-    if (sigsetjmp(threads[tid].env, 1) == 0){
-        // Set up the stack pointer to point to the top of the stack
-        address_t sp = (address_t) stack + STACK_SIZE;
-        // Align the stack pointer to 16 bytes
-        sp &= ~0xF;
-        // Reserve space for the return address and align stack
-        sp -= sizeof(address_t);
-        
-
-        // Program counter is the entry function address
-        address_t pc = (address_t)(entry_point);
+    //Start from the clean template context (empty signal mask)
+    memcpy(thread_ctx[tid].env, ctx_template, sizeof(sigjmp_buf));
+
+    // Set up the stack pointer to point to the top of the stack
+    address_t sp = (address_t) stack + thread_ctx[tid].stack_size;
+    // Align the stack pointer to 16 bytes
+    sp &= ~0xF;
+    // Reserve space for the return address and align stack
+    sp -= sizeof(address_t);
+    // A null return address ends frame-pointer unwinds (profiler)
+    *(address_t *)sp = 0;
+    
 
+    // Program counter is the entry function address
+    address_t pc = (address_t)(entry_point);
 
-        // Set the stack pointer and program counter in the jump buffer
-        threads[tid].env->__jmpbuf[JB_SP] = translate_address(sp);
-        threads[tid].env->__jmpbuf[JB_PC] = translate_address(pc);
 
-        // The signal mask inside env must start empty  
-        sigemptyset(&threads[tid].env->__saved_mask);
-    }
+    // Set the stack pointer and program counter in the jump buffer
+    thread_ctx[tid].env->__jmpbuf[JB_SP] = translate_address(sp);
+    thread_ctx[tid].env->__jmpbuf[JB_PC] = translate_address(pc);
 }
 
 
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 /* ===================================================================== */
 /*                           Static Constants                            */
@@ -20,6 +21,49 @@
 /** Stack size per thread (in bytes). */
 #define STACK_SIZE 4096
 
+/**
+ * Spawn flag: the thread keeps live floating-point/SIMD state across switches.
+ * Its stack is enlarged by the kernel's signal-frame size so the full extended
+ * (SSE/AVX) state saved on preemption fits, and its MXCSR and x87 control word
+ * are preserved across voluntary switches.
+ */
+#define UTHREAD_FPU 0x1
+
+/**
+ * Spawn flag: the thread runs on the one shared run stack (SHARED_STACK_SIZE bytes)
+ * instead of a stack of its own. When another shared-stack thread needs the run
+ * stack, the live part of the current owner's stack is copied out to a buffer
+ * sized to its actual depth, and copied back when it runs again. This trades
+ * slower switches between shared-stack threads for memory. Addresses of locals
+ * of such a thread must not be used by other threads while it is switched out.
+ */
+#define UTHREAD_SHARED_STACK 0x2
+
+/** Maximum number of thread groups (see uthread_group_create). */
+#define MAX_GROUP_NUM 16
+
+/** Sub-bucket bits of a latency histogram: values are kept to 1/8 (12.5%) precision. */
+#define UTHREAD_HIST_SUB_BITS 3
+
+/** Number of buckets of a latency histogram (covers the whole unsigned long range). */
+#define UTHREAD_HIST_BUCKETS 512
+
+/** Bytes of closure storage in each TCB (see uthread_spawn_closure). */
+#define UTHREAD_CLOSURE_SIZE 64
+
+/** Alignment of the TCB closure storage. */
+#define UTHREAD_CLOSURE_ALIGN 16
+
+/** Size of the shared run stack used by UTHREAD_SHARED_STACK threads (in bytes). */
+#ifndef SHARED_STACK_SIZE
+#define SHARED_STACK_SIZE (64 * 1024)
+#endif
+
+/** Size of the scheduler's own stack, on which task steps run (in bytes). */
+#ifndef SCHED_STACK_SIZE
+#define SCHED_STACK_SIZE (16 * 1024)
+#endif
+
 /**
  * @brief Function pointer type for a thread's entry point.
  *
@@ -43,20 +87,122 @@ typedef enum {
 } thread_state_t;
 
 /**
- * @brief Thread Control Block (TCB)
+ * @brief Why a BLOCKED thread is blocked, besides uthread_block / uthread_sleep.
+ *
+ * uthread_resume only wakes threads whose wait reason is THREAD_WAIT_NONE; the
+ * other reasons are cleared by the event the thread waits for.
+ */
+typedef enum {
+    THREAD_WAIT_NONE = 0, /**< Not waiting on a library event. */
+    THREAD_WAIT_OFFLOAD,  /**< Waiting for a uthread_offload call to complete. */
+    THREAD_WAIT_PERIOD,   /**< Periodic thread waiting for its next release. */
+    THREAD_WAIT_JOIN,     /**< Waiting in uthread_join for another thread to terminate. */
+    THREAD_WAIT_FUTEX     /**< Parked in uthread_wait on an address. */
+} thread_wait_t;
+
+/**
+ * @brief Thread Control Block (TCB) - hot part
  *
- * Each thread (except for the main thread) has its own allocated stack and context.
- * The TCB stores all metadata required for managing the thread.
+ * Holds only the fields the scheduler scans on every quantum (state, sleep
+ * deadline, counters). Kept small so that a scan over the whole table touches
+ * as few cache lines as possible; the register context lives in thread_ctx_t.
  */
 typedef struct {
     int tid;                    /**< Unique thread identifier. */
     thread_state_t state;       /**< Current thread state. */
-    sigjmp_buf env;             /**< Jump buffer for context switching using sigsetjmp/siglongjmp. */
     int quantums;               /**< Count of quantums this thread has executed. */
     int sleep_until;            /**< Global quantum count until which the thread should sleep (0 if not sleeping). */
-    thread_entry_point entry;   /**< Entry point function for the thread. */
 } thread_t;
 
+/**
+ * @brief Thread context - cold part of the TCB
+ *
+ * Only touched when switching to or from the thread. Cache-line aligned so that
+ * one thread's context never shares a line with another's.
+ */
+typedef struct __attribute__((aligned(64))) {
+    sigjmp_buf env;             /**< Jump buffer for context switching using sigsetjmp/siglongjmp. */
+    thread_entry_point entry;   /**< Entry point function for the thread. */
+    char *stack;                /**< Base (lowest address) of the thread's stack; NULL for the main thread. */
+    size_t stack_size;          /**< Size of the thread's stack in bytes. */
+    int flags;                  /**< UTHREAD_* spawn flags. */
+    unsigned int mxcsr;         /**< Saved SSE control/status register (UTHREAD_FPU threads). */
+    unsigned short fpu_cw;      /**< Saved x87 control word (UTHREAD_FPU threads). */
+    char *saved_stack;          /**< Copy of the live shared-stack bytes (UTHREAD_SHARED_STACK threads). */
+    size_t saved_len;           /**< Bytes in saved_stack. */
+    size_t saved_cap;           /**< Capacity of saved_stack. */
+    size_t saved_peak;          /**< Deepest live stack seen when copying out. */
+    thread_wait_t wait;         /**< Library event the thread is blocked on. */
+    void *offload_job;          /**< Outstanding uthread_offload request, or NULL. */
+    void (*closure_invoke)(void *); /**< Runs the closure (uthread_spawn_closure threads). */
+    unsigned char closure[UTHREAD_CLOSURE_SIZE]
+        __attribute__((aligned(UTHREAD_CLOSURE_ALIGN))); /**< In-place closure object. */
+} thread_ctx_t;
+
+/**
+ * @brief Result of one step of a stackless task.
+ */
+typedef enum {
+    UTHREAD_TASK_YIELD = 0, /**< Run the task again after the other READY entries. */
+    UTHREAD_TASK_WAIT,      /**< Task parked itself (uthread_task_sleep / uthread_task_block). */
+    UTHREAD_TASK_DONE       /**< Task finished; its control block is released. */
+} uthread_task_status_t;
+
+typedef struct uthread_task uthread_task_t;
+
+/**
+ * @brief Step function of a stackless task.
+ *
+ * Called each time the task is scheduled; it must return instead of blocking.
+ * State that must survive between steps lives in task->frame, and the point to
+ * continue from in task->resume_point (see the UTHREAD_TASK_* macros).
+ */
+typedef uthread_task_status_t (*uthread_task_fn)(uthread_task_t *task);
+
+/**
+ * @brief Task Control Block
+ *
+ * A task has no stack of its own: its steps run inline in the scheduler, on the
+ * scheduler's stack (SCHED_STACK_SIZE bytes, shared by all tasks), so a task
+ * costs only this block plus its frame. Task IDs start at MAX_THREAD_NUM. Ready tasks are kept apart from
+ * threads, and each runs one step per scheduling point.
+ */
+struct uthread_task {
+    int id;                     /**< Task identifier (>= MAX_THREAD_NUM). */
+    thread_state_t state;       /**< READY, RUNNING (inside a step) or BLOCKED. */
+    int sleep_until;            /**< Global quantum count to sleep until (0 if not sleeping). */
+    int resume_point;           /**< Continuation label, 0 on the first step. */
+    uthread_task_fn step;       /**< Step function. */
+    void *frame;                /**< Caller-owned state kept across steps. */
+    uthread_task_t *next;       /**< Link in the list of ready or of sleeping tasks. */
+};
+
+/* Protothread-style helpers for writing a step function as straight-line code.
+ * Locals do not survive a suspension point; keep them in task->frame.     */
+#define UTHREAD_TASK_BEGIN(task)  switch ((task)->resume_point) { case 0:
+#define UTHREAD_TASK_END(task)    } return UTHREAD_TASK_DONE
+#define UTHREAD_TASK_YIELD(task) \
+    do { (task)->resume_point = __LINE__; return UTHREAD_TASK_YIELD; case __LINE__:; } while (0)
+#define UTHREAD_TASK_SLEEP(task, n) \
+    do { (task)->resume_point = __LINE__; uthread_task_sleep((task), (n)); \
+         return UTHREAD_TASK_WAIT; case __LINE__:; } while (0)
+#define UTHREAD_TASK_BLOCK(task) \
+    do { (task)->resume_point = __LINE__; uthread_task_block(task); \
+         return UTHREAD_TASK_WAIT; case __LINE__:; } while (0)
+
+/**
+ * @brief Log-linear (HDR-style) histogram.
+ *
+ * Values below 2^UTHREAD_HIST_SUB_BITS have a bucket each; above that, every
+ * power of two is split into 2^UTHREAD_HIST_SUB_BITS equal buckets.
+ */
+typedef struct {
+    unsigned long count;        /**< Number of recorded values. */
+    unsigned long sum;          /**< Sum of recorded values. */
+    unsigned long max;          /**< Largest recorded value. */
+    unsigned int buckets[UTHREAD_HIST_BUCKETS]; /**< Per-bucket counts. */
+} uthread_hist_t;
+
 /* ===================================================================== */
 /*                           External Interface                          */
 /* ===================================================================== */
@@ -73,6 +219,30 @@ typedef struct {
  */
 int uthread_init(int quantum_usecs);
 
+/**
+ * @brief Initializes the library in deterministic simulated-time mode.
+ *
+ * Like uthread_init, but no timer or signal is used. Time advances only through
+ * uthread_tick(): each quantum lasts a number of ticks, after which the running
+ * thread is preempted. With seed == 0 every quantum is exactly quantum_steps
+ * ticks; otherwise each quantum length is drawn from [1, quantum_steps] by a
+ * PRNG seeded with seed, so a given seed always reproduces the same schedule.
+ *
+ * @param quantum_steps Maximum number of ticks per quantum (must be positive).
+ * @param seed PRNG seed for quantum lengths (0 for a fixed length).
+ * @return 0 on success; -1 on error.
+ */
+int uthread_init_deterministic(int quantum_steps, unsigned long seed);
+
+/**
+ * @brief Instrumentation point for the deterministic mode.
+ *
+ * Advances the simulated clock by one step and preempts the calling thread when
+ * the current quantum's budget is used up. A no-op when the library was set up
+ * with uthread_init.
+ */
+void uthread_tick(void);
+
 /**
  * @brief Creates a new thread.
  *
@@ -85,6 +255,53 @@ int uthread_init(int quantum_usecs);
  */
 int uthread_spawn(thread_entry_point entry_point);
 
+/**
+ * @brief Creates a new thread with spawn options.
+ *
+ * Same as uthread_spawn, with a bitwise OR of UTHREAD_* flags. Threads that use
+ * floating-point or vector registers across preemption points should pass
+ * UTHREAD_FPU; integer-only threads should pass 0 and keep the small stack.
+ *
+ * @param entry_point Pointer to the thread’s entry function (must not be NULL).
+ * @param flags Spawn flags (0, or UTHREAD_FPU and/or UTHREAD_SHARED_STACK).
+ * @return On success, returns the new thread’s ID; on failure, returns -1.
+ */
+int uthread_spawn_ex(thread_entry_point entry_point, int flags);
+
+/**
+ * @brief Creates a batch of threads in a single critical section.
+ *
+ * Equivalent to calling uthread_spawn for each of entries[0..n-1] in order, but
+ * the free-slot scan, stack setup and READY-queue appends are done in one pass
+ * with SIGVTALRM masked once. Either all n threads are created or none is.
+ *
+ * @param entries Array of n entry functions (none may be NULL).
+ * @param n Number of threads to create (must be positive).
+ * @param tids_out If not NULL, receives the n new thread IDs in order.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_spawn_many(const thread_entry_point entries[], int n, int tids_out[]);
+
+/**
+ * @brief Creates a thread that runs a closure stored in its TCB.
+ *
+ * construct(dst, src) is called with SIGVTALRM masked to build the closure in the
+ * thread's UTHREAD_CLOSURE_SIZE-byte buffer (no heap allocation). The new thread
+ * calls invoke(dst), which must also destroy the closure, and then terminates.
+ * Used by the C++ wrapper in uthreads.hpp.
+ *
+ * @param invoke Runs (and destroys) the closure.
+ * @param construct Builds the closure at dst from src.
+ * @param src Passed to construct.
+ * @param size Size of the closure (at most UTHREAD_CLOSURE_SIZE).
+ * @param flags As for uthread_spawn_ex.
+ * @param gen_out If not NULL, receives the new thread's generation (see
+ *                uthread_join_generation).
+ * @return The new thread's ID on success; -1 on error.
+ */
+int uthread_spawn_closure(void (*invoke)(void *), void (*construct)(void *, void *),
+                          void *src, size_t size, int flags, unsigned int *gen_out);
+
 /**
  * @brief Terminates a thread.
  *
@@ -99,6 +316,66 @@ int uthread_spawn(thread_entry_point entry_point);
  */
 int uthread_terminate(int tid);
 
+/**
+ * @brief Waits for a thread to terminate.
+ *
+ * Blocks the caller (the main thread included) until the thread with the given
+ * tid terminates; returns at once if it already has. A tid whose slot has since
+ * been reused by a new thread refers to the new thread; use
+ * uthread_join_generation to avoid that.
+ *
+ * @param tid Thread ID to wait for (not 0 and not the caller).
+ * @return 0 on success; -1 on error.
+ */
+int uthread_join(int tid);
+
+/**
+ * @brief Waits for one particular thread to terminate.
+ *
+ * Every spawn into a slot gets a new generation number. Like uthread_join, but
+ * returns at once if the slot now holds a different generation, i.e. the thread
+ * has finished and its tid was reused.
+ *
+ * @param tid Thread ID to wait for (not 0 and not the caller).
+ * @param gen Generation from uthread_get_generation or uthread_spawn_closure.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_join_generation(int tid, unsigned int gen);
+
+/**
+ * @brief Returns the generation of the thread currently in slot tid.
+ *
+ * @return The generation; 0 if tid is out of range.
+ */
+unsigned int uthread_get_generation(int tid);
+
+/**
+ * @brief Gives up the rest of the quantum; the caller goes to the end of the READY queue.
+ */
+void uthread_yield(void);
+
+/**
+ * @brief Parks the caller on addr if *addr still equals expected.
+ *
+ * The comparison and the parking happen with SIGVTALRM masked, so a uthread
+ * that changes *addr and then calls uthread_wake cannot slip in between. Waiters
+ * are kept per address in FIFO order. The main thread may wait.
+ *
+ * @param addr Address to wait on.
+ * @param expected Value *addr must hold for the caller to park.
+ * @return 0 once woken by uthread_wake; 1 if *addr != expected; -1 on error.
+ */
+int uthread_wait(const volatile int *addr, int expected);
+
+/**
+ * @brief Readies up to n threads parked on addr, oldest first.
+ *
+ * @param addr Address the threads wait on.
+ * @param n Maximum number of threads to wake (INT_MAX for all).
+ * @return Number of threads woken; -1 on error.
+ */
+int uthread_wake(const volatile int *addr, int n);
+
 /**
  * @brief Blocks a thread.
  *
@@ -118,12 +395,54 @@ int uthread_block(int tid);
  * Moves a thread from the BLOCKED state to the READY state.
  * If the thread is already in RUNNING or READY state, this call has no effect.
  * It is an error if no thread with the given tid exists.
+ * A task ID (see uthread_task_spawn) resumes a task parked with uthread_task_block.
  *
- * @param tid Thread ID to resume.
+ * @param tid Thread or task ID to resume.
  * @return 0 on success; -1 on error.
  */
 int uthread_resume(int tid);
 
+/**
+ * @brief Resumes a blocked thread from any kernel thread or signal handler.
+ *
+ * Same effect as uthread_resume, but only posts the request: it sets the thread's
+ * bit in a lock-free inbox with one atomic operation, and the scheduler applies
+ * it at the next scheduling point (waking the scheduler if it is idle). It is
+ * async-signal-safe and prints nothing; an invalid or terminated tid is ignored
+ * when the request is applied. If the thread is not blocked when the request is
+ * applied, it keeps a wake permit: its next uthread_block on itself (or
+ * uthread_block_and_switch_to) returns at once instead of blocking, so
+ * "while (!done) uthread_block(self);" cannot miss a wakeup.
+ *
+ * @param tid Thread ID to resume.
+ * @return 0 if the request was posted; -1 if tid is out of range.
+ */
+int uthread_resume_async(int tid);
+
+/**
+ * @brief Hands the CPU directly to another thread.
+ *
+ * The target, which must be READY or blocked by uthread_block (not sleeping and
+ * not waiting on a library event), runs immediately for the rest of the current
+ * quantum; the quantum counters and the timer are left alone. The caller goes to
+ * the end of the READY queue.
+ *
+ * @param tid Thread ID to run (not the caller).
+ * @return 0 on success (once the caller runs again); -1 on error.
+ */
+int uthread_switch_to(int tid);
+
+/**
+ * @brief Blocks the calling thread and hands the CPU directly to another thread.
+ *
+ * Same as uthread_switch_to, but the caller becomes BLOCKED, as with
+ * uthread_block, until someone resumes it. The main thread may not call it.
+ *
+ * @param tid Thread ID to run (not the caller).
+ * @return 0 on success (once the caller is resumed and runs); -1 on error.
+ */
+int uthread_block_and_switch_to(int tid);
+
 /**
  * @brief Puts the running thread to sleep.
  *
@@ -137,6 +456,144 @@ int uthread_resume(int tid);
  */
 int uthread_sleep(int num_quantums);
 
+/**
+ * @brief Function run by uthread_offload on a helper kernel thread.
+ */
+typedef void *(*uthread_offload_fn)(void *arg);
+
+/**
+ * @brief Runs a blocking call on a helper kernel thread.
+ *
+ * Hands fn(arg) to a small pool of helper kernel threads (started on first use)
+ * and blocks the calling thread until it returns; the other threads keep running
+ * meanwhile. Use it for calls that cannot be made non-blocking (fsync,
+ * getaddrinfo, reads from slow disks). fn must not call the thread library.
+ * uthread_resume does not wake a thread waiting here. If every thread is waiting,
+ * the process sleeps until a call completes.
+ *
+ * @param fn Function to run (must not be NULL).
+ * @param arg Argument passed to fn.
+ * @param result If not NULL, receives fn's return value.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_offload(uthread_offload_fn fn, void *arg, void **result);
+
+/**
+ * @brief Puts a thread in the periodic real-time class.
+ *
+ * The thread is released at absolute boundaries every period quantums (the first
+ * release is now) and may run budget quantums per period at real-time priority.
+ * READY real-time threads with budget left are picked earliest-deadline-first
+ * (deadline = end of the current period) ahead of the round-robin queue. A thread
+ * that exhausts its budget falls back to round robin until its next release.
+ * The request is rejected if the total utilisation (sum of budget/period over all
+ * periodic threads) would exceed 1. period == 0 returns the thread to round robin.
+ * A thread waiting in uthread_wait_next_period stays parked until its first
+ * release under the new parameters, or becomes READY if the class is cleared.
+ *
+ * @param tid Thread ID.
+ * @param period Period in quantums (positive, or 0 to clear).
+ * @param budget Quantums per period (1..period; ignored when clearing).
+ * @return 0 on success; -1 on error or if admission control rejects the set.
+ */
+int uthread_set_periodic(int tid, int period, int budget);
+
+/**
+ * @brief Ends the current job of the calling periodic thread.
+ *
+ * Blocks the caller until its next release. Must be called by a thread set up
+ * with uthread_set_periodic.
+ *
+ * @return 0 on success; -1 on error.
+ */
+int uthread_wait_next_period(void);
+
+/**
+ * @brief Returns the number of overruns of a periodic thread.
+ *
+ * A job overruns when it uses up its budget, or reaches its deadline, before
+ * calling uthread_wait_next_period. Each job is counted at most once.
+ *
+ * @param tid Thread ID.
+ * @return Number of overruns; -1 on error.
+ */
+int uthread_get_overruns(int tid);
+
+/**
+ * @brief Creates a thread group with a CPU quota.
+ *
+ * Threads in the group (and in its descendant groups) may together run at most
+ * quota quantums in every period quantums; periods start at absolute multiples
+ * of period counted from the group's creation. A thread is throttled while any
+ * group on its path to the root has used up its quota: the round-robin scheduler
+ * passes over it until that group's next period. When every READY thread is
+ * throttled the scheduler idles, counting a quantum per quantum of wall time,
+ * until a period rolls over or another thread becomes ready, so the quota holds
+ * even when the group is the only runnable work.
+ *
+ * @param parent Parent group ID, or -1 for a top-level group.
+ * @param quota Quantums per period (1..period).
+ * @param period Accounting period in quantums (must be positive).
+ * @return On success, the new group's ID; on failure, -1.
+ */
+int uthread_group_create(int parent, int quota, int period);
+
+/**
+ * @brief Moves a thread into a group.
+ *
+ * A thread belongs to at most one group; it is charged, together with the
+ * group's ancestors, for every quantum it runs.
+ *
+ * @param gid Group ID, or -1 to take the thread out of its group.
+ * @param tid Thread ID.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_group_add(int gid, int tid);
+
+/**
+ * @brief Copies a ready-to-running latency histogram.
+ *
+ * Records, for every switch to a thread, the time in nanoseconds since it last
+ * became READY (spawned, resumed, woken, or preempted).
+ *
+ * @param tid Thread ID, or -1 for the histogram over all threads.
+ * @param out Receives the histogram.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_get_latency_hist(int tid, uthread_hist_t *out);
+
+/**
+ * @brief Copies a wake-up lateness histogram.
+ *
+ * Records, for every thread woken from uthread_sleep, how many quantums after
+ * its wake-up quantum it actually started running.
+ *
+ * @param tid Thread ID, or -1 for the histogram over all threads.
+ * @param out Receives the histogram.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_get_lateness_hist(int tid, uthread_hist_t *out);
+
+/**
+ * @brief Returns a percentile of a histogram.
+ *
+ * @param hist Histogram (from uthread_get_latency_hist or uthread_get_lateness_hist).
+ * @param percentile Percentile in [0, 100].
+ * @return Upper bound of the bucket holding the percentile (0 if hist is empty).
+ */
+unsigned long uthread_hist_percentile(const uthread_hist_t *hist, double percentile);
+
+/**
+ * @brief Configures the starvation watchdog.
+ *
+ * When enabled, the scheduler reports on stderr every thread that has been
+ * READY for more than max_wait_quantums quantums without running (once per wait).
+ *
+ * @param max_wait_quantums Threshold in quantums; 0 disables the watchdog.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_set_watchdog(int max_wait_quantums);
+
 /**
  * @brief Returns the calling thread's ID.
  *
@@ -144,6 +601,65 @@ int uthread_sleep(int num_quantums);
  */
 int uthread_get_tid();
 
+/**
+ * @brief Lets the library retune the quantum length to the load.
+ *
+ * At every scheduling decision the quantum is set to the longest value that
+ * lets all runnable threads run within max_rotation_usecs, but never so short
+ * that the measured switch cost exceeds target_overhead_pct percent of it; the
+ * result is clamped to [min_usecs, max_usecs]. Sleep lengths and periodic
+ * parameters stay in quantums, so they stretch with it. Passing 0 for both
+ * bounds turns the mode off and keeps the current quantum. Not available in
+ * deterministic mode.
+ *
+ * @return 0 on success, -1 on invalid bounds.
+ */
+int uthread_set_adaptive(int min_usecs, int max_usecs,
+                         int target_overhead_pct, int max_rotation_usecs);
+
+/**
+ * @brief Returns the current quantum length in microseconds.
+ */
+int uthread_get_quantum_usecs(void);
+
+/**
+ * @brief Publishes scheduler state to a POSIX shared-memory segment.
+ *
+ * Creates the segment (uthread_metrics_t, see uthread_metrics.h) and keeps it
+ * updated at every context switch, so that another process, e.g. uthread_top,
+ * can watch the threads live. The segment is removed when the process exits.
+ *
+ * @param name shm_open name ("/something"), or NULL for "/uthread.<pid>".
+ * @return 0 on success, -1 on an invalid name or if already exported.
+ */
+int uthread_metrics_export(const char *name);
+
+/**
+ * @brief Starts the SIGPROF sampling profiler.
+ *
+ * Every 1/hz seconds of process CPU time the running uthread's ID and a
+ * frame-pointer backtrace are recorded. Build with -fno-omit-frame-pointer for
+ * full stacks (the caller of a frameless leaf function is not seen), and link
+ * with -rdynamic so that function names can be resolved. The SIGPROF handler
+ * runs on an alternate signal stack (sigaltstack) of the calling kernel thread,
+ * so threads on default stacks can be sampled; programs must not replace it.
+ *
+ * @param hz Sampling rate in samples per second of CPU time.
+ * @return 0 on success, -1 on error.
+ */
+int uthread_profiler_start(int hz);
+
+/**
+ * @brief Stops the profiler and writes the samples as folded stacks.
+ *
+ * Each line is "uthread_<tid>;outer;...;leaf <count>", ready for
+ * flamegraph.pl.
+ *
+ * @param path Output file, or NULL for stdout.
+ * @return Number of samples written, or -1 on error.
+ */
+int uthread_profiler_stop(const char *path);
+
 /**
  * @brief Returns the total number of quantums since the library was initialized.
  *
@@ -165,6 +681,85 @@ int uthread_get_total_quantums();
  */
 int uthread_get_quantums(int tid);
 
+/**
+ * @brief Returns the peak stack usage of the thread with the specified tid.
+ *
+ * New stacks are painted with a fixed byte pattern; the high-water mark is the
+ * distance from the top of the stack to the deepest byte that no longer holds
+ * the pattern. The value includes signal frames pushed on preemption.
+ * For UTHREAD_SHARED_STACK threads it is the deepest live stack copied out so far.
+ * It is an error to query the main thread (tid == 0), which runs on the process stack.
+ *
+ * @param tid Thread ID.
+ * @return Peak number of stack bytes used; -1 on error.
+ */
+int uthread_stack_usage(int tid);
+
+/**
+ * @brief Creates a stackless task.
+ *
+ * The task is added to the end of the ready-task list. At every scheduling
+ * point, each task on that list runs one step inline in the scheduler with
+ * SIGVTALRM masked; a step does not consume a quantum and cannot be preempted,
+ * so it must be short. Steps must not call uthread_sleep, uthread_block or
+ * uthread_terminate on themselves (they would act on the underlying thread);
+ * use the uthread_task_* calls instead. The number of tasks is not limited.
+ *
+ * @param step Step function (must not be NULL).
+ * @param frame Caller-owned state passed to every step as task->frame.
+ * @return On success, the new task's ID; on failure, -1.
+ */
+int uthread_task_spawn(uthread_task_fn step, void *frame);
+
+/**
+ * @brief Parks the running task for a number of quantums.
+ *
+ * Must be called from within the task's step function, which must then return
+ * UTHREAD_TASK_WAIT. The task is moved to the end of the ready-task list once
+ * num_quantums quantums have started.
+ *
+ * @param task The task whose step is running.
+ * @param num_quantums Number of quantums to sleep (must be positive).
+ * @return 0 on success; -1 on error.
+ */
+int uthread_task_sleep(uthread_task_t *task, int num_quantums);
+
+/**
+ * @brief Parks the running task until uthread_resume(task->id).
+ *
+ * Must be called from within the task's step function, which must then return
+ * UTHREAD_TASK_WAIT.
+ *
+ * @param task The task whose step is running.
+ * @return 0 on success; -1 on error.
+ */
+int uthread_task_block(uthread_task_t *task);
+
+/**
+ * @brief Preemption-safe logging for threads.
+ *
+ * Formats the message (vsnprintf, at most 255 bytes) into a per-thread ring
+ * buffer without touching stdio, so it is safe even if the thread is preempted
+ * in the middle of it. The scheduler flushes all buffers to stdout with one
+ * writev per quantum (or when idle, or at exit). Messages of one thread stay in
+ * order; messages of different threads are interleaved per flush. Output is not
+ * ordered with respect to printf.
+ *
+ * vsnprintf needs most of a STACK_SIZE stack, so for threads on one (those
+ * spawned without flags) the message is formatted on the scheduler stack with
+ * SIGVTALRM masked, at the cost of two sigprocmask calls. Other threads format
+ * in place and need about 4 KiB of free stack.
+ *
+ * @param fmt printf-style format.
+ * @return Number of bytes logged; -1 on error.
+ */
+int uthread_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * @brief Writes out everything logged with uthread_log so far.
+ */
+void uthread_log_flush(void);
+
 /* ===================================================================== */
 /*              Internal Helper Functions and Structures                 */
 /* ===================================================================== */
@@ -187,10 +782,10 @@ void schedule_next(void);
  *
  * Uses sigsetjmp and siglongjmp to save the current thread's context and restore the context of the next thread.
  *
- * @param current Pointer to the current thread's TCB.
- * @param next Pointer to the next thread's TCB.
+ * @param current Pointer to the current thread's context.
+ * @param next Pointer to the next thread's context.
  */
-void context_switch(thread_t *current, thread_t *next);
+void context_switch(thread_ctx_t *current, thread_ctx_t *next);
 
 /**
  * @brief Timer signal handler.
@@ -210,7 +805,7 @@ void timer_handler(int signum);
  * address translation (see provided reference implementation) when initializing the context.
  *
  * @param tid Thread ID.
- * @param stack Pointer to the thread's allocated stack (a char array).
+ * @param stack Pointer to the thread's allocated stack (thread_ctx[tid].stack_size bytes).
  * @param entry_point Pointer to the thread's entry function.
  */
 void setup_thread(int tid, char *stack, thread_entry_point entry_point);
@@ -0,0 +1,219 @@
+#ifndef _UTHREADS_HPP
+#define _UTHREADS_HPP
+
+/*
+ * Header-only C++ layer over uthreads.h.
+ *
+ *     uthread::mutex m;
+ *     int hits = 0;
+ *     uthread::thread t = uthread::spawn([&] {
+ *         uthread::lock_guard<uthread::mutex> g(m);
+ *         ++hits;
+ *     });
+ *     t.join();                       // or let the destructor join
+ *
+ * A callable is moved into the small buffer in the thread's TCB (at most
+ * UTHREAD_CLOSURE_SIZE bytes, checked at compile time), so spawning never
+ * allocates. Dispatch goes through per-type function templates; there are
+ * no virtual calls. Errors are reported as in the C API (message on stderr,
+ * -1), not as exceptions: a thread whose spawn failed is not joinable().
+ */
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "uthreads.h"
+}
+
+namespace uthread {
+
+namespace detail {
+
+/* Moves a callable of type F into the TCB and runs it there. */
+template <class F>
+struct launcher {
+    static_assert(sizeof(F) <= UTHREAD_CLOSURE_SIZE,
+                  "closure does not fit in the TCB buffer; capture less or by reference");
+    static_assert(alignof(F) <= UTHREAD_CLOSURE_ALIGN, "closure is over-aligned");
+
+    static void construct(void *dst, void *src)
+    {
+        ::new (dst) F(std::move(*static_cast<F *>(src)));
+    }
+
+    static void invoke(void *p)
+    {
+        F *f = static_cast<F *>(p);
+        (*f)();
+        f->~F();
+    }
+
+    static int launch(F &&f, int flags, unsigned int *gen)
+    {
+        return uthread_spawn_closure(&invoke, &construct, &f, sizeof(F), flags, gen);
+    }
+};
+
+/* A plain entry function is stored as is: nothing to move or destroy.
+ * Unlike with uthread_spawn, it may simply return when done.          */
+template <>
+struct launcher<thread_entry_point> {
+    static void construct(void *dst, void *src)
+    {
+        *static_cast<thread_entry_point *>(dst) = *static_cast<thread_entry_point *>(src);
+    }
+
+    static void invoke(void *p) { (*static_cast<thread_entry_point *>(p))(); }
+
+    static int launch(thread_entry_point f, int flags, unsigned int *gen)
+    {
+        return uthread_spawn_closure(&invoke, &construct, &f, sizeof f, flags, gen);
+    }
+};
+
+} // namespace detail
+
+/**
+ * @brief Owning handle to a uthread; joins in its destructor.
+ *
+ * The handle keeps the thread's generation along with its tid, so joining a
+ * thread that finished and whose tid was reused returns at once.
+ */
+class thread {
+public:
+    thread() noexcept : tid_(-1), gen_(0) {}
+
+    /**
+     * @brief Spawns a thread that runs f().
+     * @param flags UTHREAD_* spawn flags, as for uthread_spawn_ex.
+     */
+    template <class F, class = typename std::enable_if<
+                           !std::is_same<typename std::decay<F>::type, thread>::value>::type>
+    explicit thread(F &&f, int flags = 0)
+    {
+        typedef typename std::decay<F>::type fn_t;
+        fn_t fn(std::forward<F>(f));
+        tid_ = detail::launcher<fn_t>::launch(std::move(fn), flags, &gen_);
+    }
+
+    thread(thread &&other) noexcept : tid_(other.tid_), gen_(other.gen_) { other.tid_ = -1; }
+
+    thread &operator=(thread &&other) noexcept
+    {
+        if (this != &other) {
+            join();
+            tid_ = other.tid_;
+            gen_ = other.gen_;
+            other.tid_ = -1;
+        }
+        return *this;
+    }
+
+    thread(const thread &) = delete;
+    thread &operator=(const thread &) = delete;
+
+    ~thread() { join(); }
+
+    bool joinable() const noexcept { return tid_ > 0; }
+    int get_id() const noexcept { return tid_; }
+
+    /** @brief Waits for the thread to finish; 0 on success (or if not joinable). */
+    int join() noexcept
+    {
+        if (!joinable()) return 0;
+        int ret = uthread_join_generation(tid_, gen_);
+        tid_ = -1;
+        return ret;
+    }
+
+    /** @brief Lets the thread run on without this handle. */
+    void detach() noexcept { tid_ = -1; }
+
+private:
+    int tid_;
+    unsigned int gen_;
+};
+
+/** @brief Spawns f as a new uthread. */
+template <class F>
+thread spawn(F &&f, int flags = 0)
+{
+    return thread(std::forward<F>(f), flags);
+}
+
+/**
+ * @brief Mutex for uthreads; contended waiters park in uthread_wait.
+ *
+ * locked_ is 0 (free), 1 (held) or 2 (held, maybe with waiters), so an
+ * uncontended lock/unlock pair never enters the library.
+ */
+class mutex {
+public:
+    mutex() noexcept : locked_(0) {}
+    mutex(const mutex &) = delete;
+    mutex &operator=(const mutex &) = delete;
+
+    void lock() noexcept
+    {
+        int c = 0;
+        if (__atomic_compare_exchange_n(&locked_, &c, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        if (c != 2) c = __atomic_exchange_n(&locked_, 2, __ATOMIC_ACQUIRE);
+        while (c != 0) {
+            uthread_wait(&locked_, 2);
+            c = __atomic_exchange_n(&locked_, 2, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    bool try_lock() noexcept
+    {
+        int c = 0;
+        return __atomic_compare_exchange_n(&locked_, &c, 1, false,
+                                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void unlock() noexcept
+    {
+        if (__atomic_exchange_n(&locked_, 0, __ATOMIC_RELEASE) == 2) {
+            uthread_wake(&locked_, 1);
+        }
+    }
+
+private:
+    int locked_;
+};
+
+/** @brief Holds a lock for the lifetime of the guard. */
+template <class Mutex>
+class lock_guard {
+public:
+    explicit lock_guard(Mutex &m) : m_(m) { m_.lock(); }
+    ~lock_guard() { m_.unlock(); }
+    lock_guard(const lock_guard &) = delete;
+    lock_guard &operator=(const lock_guard &) = delete;
+
+private:
+    Mutex &m_;
+};
+
+namespace this_thread {
+
+inline int get_id() noexcept { return uthread_get_tid(); }
+
+inline void yield() noexcept { uthread_yield(); }
+
+/** @brief Sleeps for the given number of quantums (not allowed in the main thread). */
+inline int sleep_for(int quantums) noexcept { return uthread_sleep(quantums); }
+
+/** @brief Quantums the calling thread has run, the current one included. */
+inline int quantums() noexcept { return uthread_get_quantums(uthread_get_tid()); }
+
+} // namespace this_thread
+
+} // namespace uthread
+
+#endif